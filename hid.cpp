@@ -10,52 +10,161 @@
 #define SET_IDLE        0x0A
 #define SET_PROTOCOL    0x0B
 
+#define CMD_END_OF_BUFFER 0xAD
+
+// Receive and transmit queue depths. Must be even: slots are handed to
+// the SIE in order and alternate between the even and odd EP1 BDTs, so
+// slot n always lands in BDT 4 + (n & 1) (OUT) or 6 + (n & 1) (IN).
+#define RX_SLOTS 4
+#define TX_SLOTS 4
+
 void bd_fill(int index, char *buf, int size, int stat);
+void TraceUSB(int bd, int length);
+
+char inbuffer[USB_EP1_BUFF_SIZE];   // SET_REPORT data
+unsigned char rx_slot[RX_SLOTS][USB_EP1_BUFF_SIZE];
+volatile unsigned rx_done;          // packets received (ISR)
+volatile unsigned rx_armed;         // slots given to the SIE
+unsigned rx_taken;                  // packets released by ProcessIO
 
-extern char inbuffer[], outbuffer[];
+unsigned rx_depth_max;              // queue depth high-water mark
+unsigned rx_stall_count;            // times both OUT BDTs were left idle
+unsigned rx_stall_ticks;            // core timer ticks spent NAKing
+unsigned rx_stall_start;
+bool rx_stalled;
+unsigned rx_seen, tx_seen;          // counts at the last HIDStats()
 
-int bd_out, bd_in;
+unsigned char tx_slot[TX_SLOTS][USB_EP1_BUFF_SIZE];
+volatile unsigned tx_done;          // packets sent (ISR)
+volatile unsigned tx_armed;         // slots given to the SIE
+unsigned tx_queued;                 // packets committed by ProcessIO
+
+int active_config;
 char idle_rate;
 char active_protocol;               // [0] Boot Protocol [1] Report Protocol
 
 
-bool HIDReportTxd(void) { return bd_in; }
-bool HIDReportRxd(void) { return bd_out; }
+namespace {
+
+// Keep both OUT BDTs busy as long as there are free slots. Called from
+// the ISR and, with the USB interrupt masked, from HIDRxReport().
+void rx_arm(void) {
+    while ((rx_armed - rx_done < 2) && (rx_armed - rx_taken < RX_SLOTS)) {
+        int bd = 4 + (rx_armed & 1);
+        bd_fill(bd, (char*)rx_slot[rx_armed % RX_SLOTS], USB_EP1_BUFF_SIZE,
+                bd & 1 ? 0xc0 : 0x80);
+        rx_armed++;
+    }
+    if (rx_armed == rx_done) {      // nothing armed, host is NAKed
+        if (!rx_stalled) {
+            rx_stalled = true;
+            rx_stall_count++;
+            rx_stall_start = _CP0_GET_COUNT();
+        }
+    } else if (rx_stalled) {
+        rx_stalled = false;
+        rx_stall_ticks += _CP0_GET_COUNT() - rx_stall_start;
+    }
+}
+
+void rx_complete(int length) {
+    unsigned char *p = rx_slot[rx_done % RX_SLOTS];
+    unsigned depth;
+    // short bulk packet: make sure ProcessIO stops at the end of it
+    while (length < USB_EP1_BUFF_SIZE) p[length++] = CMD_END_OF_BUFFER;
+    depth = ++rx_done - rx_taken;
+    if (depth > rx_depth_max) rx_depth_max = depth;
+    rx_arm();
+}
+
+// Send queued reports in order, keeping both IN BDTs busy. Called from
+// the ISR and, with the USB interrupt masked, from HIDTxReport().
+void tx_arm(void) {
+    while ((tx_armed != tx_queued) && (tx_armed - tx_done < 2)) {
+        int bd = 6 + (tx_armed & 1);
+        bd_fill(bd, (char*)tx_slot[tx_armed % TX_SLOTS], USB_EP1_BUFF_SIZE,
+                bd & 1 ? 0xc0 : 0x80);
+        tx_armed++;
+    }
+}
+
+}
+
+bool HIDConfigured(void) { return active_config != 0; }
+
+unsigned char *HIDReportRxd(void) {
+    return rx_done != rx_taken ? rx_slot[rx_taken % RX_SLOTS] : 0;
+}
 
 void HIDRxReport(void) {
-    int bd = bd_out ^ 1;
-    bd_out = 0;
-    bd_fill(bd, inbuffer, USB_EP1_BUFF_SIZE, bd & 1 ? 0xc0 : 0x80);
+    rx_taken++;
+    IEC1bits.USBIE = 0;
+    rx_arm();
+    IEC1bits.USBIE = 1;
 }
 
-void HIDTxReport(unsigned char *buf) {
-    int bd = bd_in ^ 1;
-    bd_in = 0;
-    bd_fill(bd, (char*)buf, USB_EP1_BUFF_SIZE, bd & 1 ? 0xc0 : 0x80);
+// Next free IN report buffer, or 0 if all TX_SLOTS are waiting to go.
+unsigned char *HIDTxBuffer(void) {
+    return tx_queued - tx_done < TX_SLOTS ? tx_slot[tx_queued % TX_SLOTS] : 0;
+}
+
+// Queue the buffer returned by HIDTxBuffer(); the ISR sends it.
+void HIDTxReport(void) {
+    tx_queued++;
+    IEC1bits.USBIE = 0;
+    tx_arm();
+    IEC1bits.USBIE = 1;
+}
+
+// {reports received} {reports sent} {OUT queue depth max} {OUT NAKs}
+// {OUT NAK ticks} since the last call.
+void HIDStats(unsigned *stats) {
+    IEC1bits.USBIE = 0;
+    stats[0] = rx_done - rx_seen;
+    stats[1] = tx_done - tx_seen;
+    stats[2] = rx_depth_max;
+    stats[3] = rx_stall_count;
+    stats[4] = rx_stall_ticks;
+    if (rx_stalled) {               // count the NAKing so far
+        stats[4] += _CP0_GET_COUNT() - rx_stall_start;
+        rx_stall_start = _CP0_GET_COUNT();
+    }
+    rx_seen = rx_done;
+    tx_seen = tx_done;
+    rx_depth_max = rx_stall_count = rx_stall_ticks = 0;
+    IEC1bits.USBIE = 1;
 }
 
+// Both configurations use EP1 with 64-byte packets, so the report
+// handling below is shared. In VENDOR_CONFIG the endpoints are bulk and
+// the host may queue several packets per frame.
 void ClassInitEndpoint(int config) {
+    active_config = config;
     if (config) {
         U1EP1 = 0x1d;   // EPCONDIS, EPRXEN, EPTXEN, EPHSHK
-        bd_out = 5; bd_in = 7;
-        HIDRxReport();
+        tx_done = tx_armed = tx_queued = tx_seen = 0;
+        rx_done = rx_armed = rx_taken = rx_seen = 0;
+        rx_stalled = false;
+        rx_arm();
     }
 }
 
-void Class_TRN_Handler(int) {
+void Class_TRN_Handler(int length) {
     int bd = U1STAT >> 2;
+    TraceUSB(bd, length);
     switch (bd) {
         case 4: // interrupt out
-        case 5: bd_out = bd; break;
+        case 5: rx_complete(length); break;
         case 6: // interrupt in
-        case 7: bd_in = bd; break;
+        case 7: tx_done++; tx_arm(); break;
         default:;
     }
 }
 
 char *ClassTrfSetupHandler(setup_packet *SetupPkt) {
+    if (active_config == VENDOR_CONFIG) return 0;   // no HID requests
     switch (SetupPkt->request) {
-        case GET_REPORT: return outbuffer;
+        case GET_REPORT: return (char*)tx_slot[(tx_queued - 1) % TX_SLOTS];
         case SET_REPORT: return inbuffer;
         case SET_IDLE: idle_rate = SetupPkt->value << 8;
         case GET_IDLE: return &idle_rate;
@@ -0,0 +1,84 @@
+// Per command cost of the firmware on the host simulation: SYSCLK cycles
+// and PGC edges per command, and the rates they allow. CPU figures count
+// only ProcessIO() with a report in hand; end-to-end ones include the bus.
+//
+//   bench [config]     1 HID (default), 2 bulk
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "sim.h"
+
+namespace {
+
+struct workload {
+    const char *name;
+    unsigned char report[64];
+    unsigned commands;          // per report
+};
+
+// JTAG TCK bits: four PGC periods, eight edges, each
+const unsigned EDGES_PER_BIT = 8;
+const unsigned REPORTS = 200;
+
+workload version = {"GET_VERSION", {0x76}, 1};
+workload download = {"DOWNLOAD_DATA", {0xA7, 0xA8, 61}, 2};
+workload sendcmd = {"JT2_SENDCMD", {0xA6, 60}, 30};
+workload xfer32 = {"JT2_XFERDATA32_LIT", {0xA9, 0xA6, 60}, 13};
+workload setmode = {"JT2_SETMODE", {0xA6, 60}, 20};
+
+void fill(void) {
+    int i;
+    for (i = 0; i < 61; i++) download.report[3 + i] = i;
+    for (i = 0; i < 30; i++) {
+        sendcmd.report[2 + i * 2] = 0xBB;
+        sendcmd.report[3 + i * 2] = 0x05;
+    }
+    for (i = 0; i < 12; i++) {
+        xfer32.report[3 + i * 5] = 0xB9;
+        memcpy(xfer32.report + 4 + i * 5, "\x78\x56\x34\x12", 4);
+    }
+    for (i = 0; i < 20; i++) {
+        setmode.report[2 + i * 3] = 0xBC;
+        setmode.report[3 + i * 3] = 6;
+        setmode.report[4 + i * 3] = 0x1f;
+    }
+}
+
+void measure(const workload &w) {
+    unsigned long long busy = sim::busy_cycles(), edges = sim::pgc_edges;
+    unsigned start = sim::ticks(), i, commands = w.commands * REPORTS;
+    unsigned char reply[64];
+    double cycles, ms, cpu;
+    for (i = 0; i < REPORTS; i++) sim::send(w.report);
+    if (!sim::drain(10000)) {
+        printf("%-20s timed out\n", w.name);
+        exit(1);
+    }
+    while (sim::receive(reply)) ;
+    ms = (double)(sim::ticks() - start) / SIM_TICKS_MS;
+    busy = sim::busy_cycles() - busy;
+    edges = sim::pgc_edges - edges;
+    cycles = (double)busy / commands;
+    cpu = (double)SIM_SYSCLK / cycles;
+    printf("%-20s %9.0f %9.1f %11.0f %11.0f %11.0f\n", w.name, cycles,
+        (double)edges / commands, cpu, cpu * edges / commands / EDGES_PER_BIT,
+        commands / ms * 1000);
+}
+
+}//anonymous
+
+int main(int argc, char **argv) {
+    int config = argc > 1 ? atoi(argv[1]) : 1;
+    fill();
+    sim::boot(config);
+    printf("configuration %d, %u reports each\n", config, REPORTS);
+    printf("%-20s %9s %9s %11s %11s %11s\n", "command", "cycles", "edges",
+        "cmd/s cpu", "bit/s cpu", "cmd/s e2e");
+    measure(version);
+    measure(download);
+    measure(sendcmd);
+    measure(xfer32);
+    measure(setmode);
+    return 0;
+}
@@ -0,0 +1,59 @@
+// USB throughput of the two configurations over the simulated bus, in
+// payload KB/s: reports out only (CMD_DOWNLOAD_DATA), replies in only
+// (CMD_UPLOAD_DATA_NOLEN), and a full 64-byte reply for each report.
+//
+//   loopback [config]      1 HID (default), 2 bulk
+
+#include <cstdio>
+#include <cstdlib>
+#include "sim.h"
+#include "pickit.h"
+
+namespace {
+
+struct traffic {
+    const char *name;
+    unsigned char report[64];
+    unsigned out, in;           // payload bytes per report
+};
+
+const unsigned REPORTS = 1000;
+
+traffic download = {"out", {CMD_CLEAR_DOWNLOAD_BUFFER, CMD_DOWNLOAD_DATA, 61}, 61, 0};
+traffic upload = {"in", {CMD_UPLOAD_DATA_NOLEN}, 0, 64};
+traffic both = {"out + in", {CMD_CLEAR_DOWNLOAD_BUFFER, CMD_DOWNLOAD_DATA, 60}, 60, 64};
+
+void measure(const traffic &t) {
+    unsigned start = sim::ticks(), i, replies = 0;
+    unsigned char reply[64];
+    double ms;
+    for (i = 0; i < REPORTS; i++) sim::send(t.report);
+    if (!sim::drain(10000)) {
+        printf("%-10s timed out\n", t.name);
+        exit(1);
+    }
+    ms = (double)(sim::ticks() - start) / SIM_TICKS_MS;
+    while (sim::receive(reply)) replies++;
+    if (replies != (t.in ? REPORTS : 0)) {
+        printf("%-10s %u replies to %u reports\n", t.name, replies, REPORTS);
+        exit(1);
+    }
+    printf("%-10s %9.1f %9.1f %9.1f\n", t.name, ms,
+        REPORTS * t.out / ms * 1000 / 1024, REPORTS * t.in / ms * 1000 / 1024);
+}
+
+}//anonymous
+
+int main(int argc, char **argv) {
+    int config = argc > 1 ? atoi(argv[1]) : 1;
+    unsigned i;
+    for (i = 3; i < 64; i++) download.report[i] = both.report[i] = i;
+    both.report[63] = CMD_UPLOAD_DATA_NOLEN;
+    sim::boot(config);
+    printf("configuration %d, %u reports each\n", config, REPORTS);
+    printf("%-10s %9s %9s %9s\n", "traffic", "ms", "KB/s out", "KB/s in");
+    measure(download);
+    measure(upload);
+    measure(both);
+    return 0;
+}
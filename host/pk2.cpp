@@ -0,0 +1,259 @@
+#include <cstdio>
+#include <cstring>
+#include "pk2.h"
+#include "target.h"
+
+#define ETAP_FASTDATA   0x0E
+#define MTAP_SW_MTAP    0x04
+#define MTAP_SW_ETAP    0x05
+#define MTAP_COMMAND    0x07
+#define ETAP_EJTAGBOOT  0x0C
+#define ROW_WORDS       32
+
+namespace pk2 {
+
+void send(const bytes &report) {
+    unsigned char r[64] = {0};
+    memcpy(r, report.data(), report.size() < 64 ? report.size() : 64);
+    sim::send(r);
+}
+
+bool reply(unsigned char *report, unsigned ms) {
+    if (!sim::run([]() { return sim::received() > 0; }, ms)) return false;
+    return sim::receive(report);
+}
+
+bytes upload(void) {
+    unsigned char r[64];
+    send({CMD_UPLOAD_DATA});
+    if (!reply(r)) return bytes();
+    return bytes(r + 1, r + 1 + (r[0] < 63 ? r[0] : 63));
+}
+
+unsigned status(void) {
+    unsigned char r[64];
+    send({CMD_READ_STATUS});
+    return reply(r) ? r[0] | r[1] << 8 : ~0u;
+}
+
+void script(const bytes &ops) {
+    bytes r = {CMD_EXECUTE_SCRIPT, (unsigned char)ops.size()};
+    r.insert(r.end(), ops.begin(), ops.end());
+    send(r);
+    sim::drain(10000);
+}
+
+bytes run(const bytes &ops) {
+    unsigned char r[64];
+    bytes b = {CMD_CLEAR_UPLOAD_BUFFER, CMD_EXECUTE_SCRIPT, (unsigned char)ops.size()};
+    b.insert(b.end(), ops.begin(), ops.end());
+    b.push_back(CMD_UPLOAD_DATA);
+    send(b);
+    if (!reply(r)) return bytes();
+    return bytes(r + 1, r + 1 + (r[0] < 63 ? r[0] : 63));
+}
+
+void put32(bytes &b, unsigned v) {
+    for (int i = 0; i < 4; i++) b.push_back(v >> (i * 8));
+}
+
+unsigned get32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+unsigned crc32(const unsigned *words, unsigned n) {
+    unsigned crc = ~0u;
+    const unsigned char *p = (const unsigned char *)words;
+    for (unsigned i = 0; i < n * 4; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return ~crc;
+}
+
+namespace {
+
+bool ready(const bytes &b) {
+    return (b.size() == 1) &&
+        ((b[0] & (MCHP_CPS | MCHP_CFGRDY | MCHP_FCBUSY)) == (MCHP_CPS | MCHP_CFGRDY));
+}
+
+bool fail(const char *what) {
+    fprintf(stderr, "%s failed, status %04x\n", what, status());
+    return false;
+}
+
+}//anonymous
+
+bool enter_icsp(void) {
+    script({SCRIPT_VPP_OFF, SCRIPT_MCLR_GND_ON, SCRIPT_VPP_PWM_ON, SCRIPT_BUSY_LED_ON,
+        SCRIPT_SET_ICSP_PINS, 0, SCRIPT_DELAY_LONG, 20, SCRIPT_MCLR_GND_OFF,
+        SCRIPT_VPP_ON, SCRIPT_DELAY_SHORT, 23, SCRIPT_VPP_OFF, SCRIPT_MCLR_GND_ON,
+        SCRIPT_DELAY_SHORT, 47, SCRIPT_WRITE_BYTE_LITERAL, 0xb2,
+        SCRIPT_WRITE_BYTE_LITERAL, 0xc2, SCRIPT_WRITE_BYTE_LITERAL, 0x12,
+        SCRIPT_WRITE_BYTE_LITERAL, 0x0a, SCRIPT_MCLR_GND_OFF, SCRIPT_VPP_ON,
+        SCRIPT_DELAY_LONG, 2, SCRIPT_SET_ICSP_PINS, 2});
+    if (!ready(run({SCRIPT_JT2_SETMODE, 6, 0x1f, SCRIPT_JT2_SENDCMD, MTAP_SW_MTAP,
+            SCRIPT_JT2_SENDCMD, MTAP_COMMAND, SCRIPT_JT2_XFERDATA8_LIT, MCHP_STATUS})))
+        return fail("ICSP entry");
+    return true;
+}
+
+bool erase(void) {
+    script({SCRIPT_JT2_SENDCMD, MTAP_SW_MTAP, SCRIPT_JT2_SENDCMD, MTAP_COMMAND,
+        SCRIPT_JT2_XFERDATA8_LIT, MCHP_ERASE});
+    for (int i = 0; i < 100; i++)
+        if (ready(run({SCRIPT_DELAY_LONG, 2, SCRIPT_JT2_XFERDATA8_LIT, MCHP_STATUS})))
+            return true;
+    return fail("erase");
+}
+
+bool serial_execution(void) {
+    bytes b = run({SCRIPT_JT2_SENDCMD, MTAP_SW_MTAP, SCRIPT_JT2_SENDCMD, MTAP_COMMAND,
+        SCRIPT_JT2_XFERDATA8_LIT, MCHP_STATUS, SCRIPT_JT2_XFERDATA8_LIT, MCHP_ASSERT_RST,
+        SCRIPT_JT2_SENDCMD, MTAP_SW_ETAP, SCRIPT_JT2_SENDCMD, ETAP_EJTAGBOOT,
+        SCRIPT_JT2_SENDCMD, MTAP_SW_MTAP, SCRIPT_JT2_SENDCMD, MTAP_COMMAND,
+        SCRIPT_JT2_XFERDATA8_LIT, MCHP_DE_ASSERT_RST, SCRIPT_JT2_SENDCMD, MTAP_SW_ETAP});
+    if ((b.size() != 3) || !(b[0] & MCHP_CPS)) return fail("serial execution");
+    return true;
+}
+
+bool load_pe(const std::vector<unsigned> &loader, const std::vector<unsigned> &pe) {
+    unsigned i, k;
+    for (i = 0; i < loader.size(); i += k) {
+        k = loader.size() - i < 11 ? loader.size() - i : 11;
+        bytes b = {CMD_CLEAR_DOWNLOAD_BUFFER, CMD_DOWNLOAD_DATA, (unsigned char)(k * 4)};
+        for (unsigned j = 0; j < k; j++) put32(b, loader[i + j]);
+        b.push_back(CMD_EXECUTE_SCRIPT);
+        b.push_back(k);
+        b.insert(b.end(), k, SCRIPT_JT2_XFERINST_BUF);
+        send(b);
+    }
+    script({SCRIPT_JT2_SENDCMD, ETAP_FASTDATA});
+    for (i = 0; i < pe.size(); i += k) {
+        k = pe.size() - i < 11 ? pe.size() - i : 11;
+        bytes b = {CMD_CLEAR_DOWNLOAD_BUFFER, CMD_DOWNLOAD_DATA, (unsigned char)(k * 4)};
+        for (unsigned j = 0; j < k; j++) put32(b, pe[i + j]);
+        b.push_back(CMD_EXECUTE_SCRIPT);
+        b.push_back(k);
+        b.insert(b.end(), k, SCRIPT_JT2_XFRFASTDAT_BUF);
+        send(b);
+    }
+    sim::drain(10000);
+    if (status() & ICD_TIMEOUT) return fail("PE load");
+    return true;
+}
+
+unsigned pe_version(void) {
+    bytes b = run({SCRIPT_JT2_SENDCMD, ETAP_FASTDATA, SCRIPT_JT2_XFRFASTDAT_LIT,
+        0, 0, PE_EXEC_VERSION, 0, SCRIPT_JT2_GET_PE_RESP});
+    if ((b.size() != 4) || (get32(b.data()) >> 16 != PE_EXEC_VERSION)) return 0;
+    return get32(b.data()) & 0xffff;
+}
+
+// Greedy: blank spans and runs of three or more, else literals up to the
+// next run. Records do not span reports; a literal is cut to fill one.
+std::vector<chunk> pack(const void *data, unsigned n) {
+    const unsigned char *p = (const unsigned char *)data, *end = p + n;
+    std::vector<chunk> out;
+    unsigned run, room;
+    bytes rec;
+    while (p < end) {
+        for (run = 1; (p + run < end) && (p[run] == *p); run++) ;
+        if ((*p == 0xff) && (run >= 3)) {
+            run = run < 0x400000 ? run : 0x400000;
+            rec = {(unsigned char)(0xc0 | (run - 1) >> 16), (unsigned char)(run - 1),
+                (unsigned char)((run - 1) >> 8)};
+        } else if (run >= 3) {
+            run = run < 66 ? run : 66;
+            rec = {(unsigned char)(0x80 | (run - 3)), *p};
+        } else {
+            for (run = 1; (p + run < end) && (run < 61); run++)
+                if ((p + run + 2 < end) && (p[run] == p[run + 1]) && (p[run] == p[run + 2])) break;
+            room = out.empty() ? 0 : 64 - out.back().report.size();
+            if ((room > 1) && (room < run + 1)) run = room - 1;
+            rec = {(unsigned char)(run - 1)};
+            rec.insert(rec.end(), p, p + run);
+        }
+        if (out.empty() || (out.back().report.size() + rec.size() > 64))
+            out.push_back({{CMD_DOWNLOAD_PACKED, 0}, 0});
+        bytes &r = out.back().report;
+        r.insert(r.end(), rec.begin(), rec.end());
+        r[1] = r.size() - 2;
+        out.back().expanded += run;
+        p += run;
+    }
+    return out;
+}
+
+std::vector<chunk> plain(const void *data, unsigned n) {
+    const unsigned char *p = (const unsigned char *)data;
+    std::vector<chunk> out;
+    unsigned i, k;
+    for (i = 0; i < n; i += k) {
+        k = n - i < 62 ? n - i : 62;
+        out.push_back({{CMD_DOWNLOAD_DATA, (unsigned char)k}, k});
+        out.back().report.insert(out.back().report.end(), p + i, p + i + k);
+    }
+    return out;
+}
+
+unsigned program(unsigned address, const std::vector<chunk> &data, unsigned rows,
+        unsigned window, unsigned *skipped) {
+    unsigned sent = 0, consumed = 0, i = 0, k;
+    unsigned char r[64];
+    bytes b = {CMD_CLEAR_DOWNLOAD_BUFFER, CMD_CLEAR_UPLOAD_BUFFER, CMD_PROGRAM_ROWS};
+    put32(b, address);
+    b.insert(b.end(), {(unsigned char)rows, (unsigned char)(rows >> 8), ROW_WORDS, 0});
+    send(b);
+    while (rows) {
+        // the firmware holds a packed report until its data fits; plain
+        // data past the end of the buffer would be dropped
+        k = 0;
+        if (i < data.size()) k = data[i].report[0] == CMD_DOWNLOAD_PACKED ? 1 : data[i].expanded;
+        if (k && (sent + k - consumed <= window)) {
+            send(data[i].report);
+            sent += data[i++].expanded;
+            continue;
+        }
+        if (!reply(r, 5000) || (r[0] != CMD_PROGRAM_ROWS)) return ~0u;
+        consumed = get32(r + 1);
+        rows = r[5] | r[6] << 8;
+    }
+    b = upload();
+    if (b.size() != 8) return ~0u;
+    if (skipped) *skipped = get32(b.data() + 4);
+    return get32(b.data());
+}
+
+unsigned program(unsigned address, const unsigned *words, unsigned n,
+        unsigned window, unsigned *skipped) {
+    return program(address, plain(words, n * 4), n / ROW_WORDS, window, skipped);
+}
+
+unsigned pe_crc32(unsigned address, unsigned words) {
+    unsigned char r[64];
+    bytes b = {CMD_CLEAR_DOWNLOAD_BUFFER, CMD_CLEAR_UPLOAD_BUFFER, CMD_DOWNLOAD_DATA, 8};
+    put32(b, address);
+    put32(b, words);
+    b.insert(b.end(), {CMD_EXECUTE_SCRIPT, 1, SCRIPT_JT2_PE_CRC32, CMD_UPLOAD_DATA});
+    send(b);
+    return reply(r, 60000) && (r[0] == 4) ? get32(r + 1) : 0;
+}
+
+std::vector<unsigned> sample_loader(void) {
+    std::vector<unsigned> l;
+    for (unsigned i = 0; i < 42; i++)   // the loader stored into RAM
+        l.push_back(i & 1 ? 0xaf280000 | (i * 4) : 0x3c080000 | i);
+    l.insert(l.end(), {0x3c19a000, 0x37390800, 0x03200008, 0x00000000});
+    return l;
+}
+
+std::vector<unsigned> sample_pe(unsigned words) {
+    std::vector<unsigned> p = {0xA0000900, words};
+    for (unsigned i = 0; i < words; i++) p.push_back(i * 0x9E3779B9);
+    p.insert(p.end(), {0, 0xDEAD0000});
+    return p;
+}
+
+}
@@ -0,0 +1,60 @@
+#ifndef _PK2_H    /* Guard against multiple inclusion */
+#define _PK2_H
+
+// The host side of the protocol over the simulated USB host, as
+// pic32prog's PICkit 2 adapter drives it, for the tools and tests.
+
+#include <vector>
+#include "sim.h"
+#include "pickit.h"
+
+#define ICD_TIMEOUT     0x0400      // Pk2Status.ICDTimeOut
+
+typedef std::vector<unsigned char> bytes;
+
+namespace pk2 {
+
+// Reports
+void send(const bytes &report);             // zero padded to 64
+bool reply(unsigned char *report, unsigned ms = 2000);
+bytes upload(void);                         // CMD_UPLOAD_DATA
+unsigned status(void);                      // CMD_READ_STATUS
+void script(const bytes &ops);              // CMD_EXECUTE_SCRIPT
+bytes run(const bytes &ops);                // script, then its upload
+
+// Building blocks
+void put32(bytes &b, unsigned v);
+unsigned get32(const unsigned char *p);
+unsigned crc32(const unsigned *words, unsigned n);
+
+// PIC32 steps, each checked; false with a message on stderr on failure
+bool enter_icsp(void);                      // MCHP key, MTAP status
+bool erase(void);                           // MTAP chip erase
+bool serial_execution(void);                // EJTAGBOOT through reset
+bool load_pe(const std::vector<unsigned> &loader, const std::vector<unsigned> &pe);
+unsigned pe_version(void);                  // 0 when the PE does not answer
+
+// Download reports for CMD_PROGRAM_ROWS
+struct chunk {
+    bytes report;
+    unsigned expanded;          // bytes it puts in the download buffer
+};
+std::vector<chunk> plain(const void *data, unsigned n);    // CMD_DOWNLOAD_DATA
+std::vector<chunk> pack(const void *data, unsigned n);     // CMD_DOWNLOAD_PACKED
+
+// CMD_PROGRAM_ROWS of 32-word rows, keeping no more than window bytes
+// ahead of the credits. The job's {status}, ~0 if it went wrong.
+unsigned program(unsigned address, const std::vector<chunk> &data, unsigned rows,
+    unsigned window, unsigned *skipped = 0);
+unsigned program(unsigned address, const unsigned *words, unsigned n,
+    unsigned window, unsigned *skipped = 0);
+unsigned pe_crc32(unsigned address, unsigned words);   // SCRIPT_JT2_PE_CRC32
+
+// A PE loader and image of pic32prog's shape: instructions ending in
+// the jump to the loader, and fast data {address} {words} ... {0} {jump}.
+std::vector<unsigned> sample_loader(void);
+std::vector<unsigned> sample_pe(unsigned words);
+
+}
+
+#endif /* _PK2_H */
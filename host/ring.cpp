@@ -0,0 +1,144 @@
+// The download and upload rings before and after RingBuffer: the old
+// RingBufferManager, copied from before the change, against the
+// template in pickit.cpp, on the access patterns of the firmware. Times
+// are of the host CPU, so only the ratio carries over to the PIC32.
+// Both must hand back the same data.
+//
+//   ring [reports]             default 1000000
+
+#include <vector>               // ahead of the firmware's vector macro
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "../pickit.cpp"
+
+namespace {
+
+// As it was, with its sizes: DOWNLOAD_SIZE 260, UPLOAD_SIZE 132
+class RingBufferManager {
+public:
+    RingBufferManager(unsigned char *b, int s): buffer(b), size(s)
+    { clearBuffer(); };
+    void clearBuffer(void) { read_index = write_index = 0; }
+    unsigned char readByte(void) {
+        unsigned char c;
+        if (read_index == write_index)
+        { Pk2Status.DownloadEmpty = 1; return 0; }
+        c = buffer[read_index++];
+        if (read_index == size) read_index = 0;
+        bytes_out++;
+        return c;
+    }
+    int read2buffer(unsigned char *buf, int max) {
+        int count = 0;
+        while ((read_index != write_index) && (count < max))
+            buf[count++] = readByte();
+        return count;
+    }
+    unsigned readInt(void) {
+        unsigned i = 0;
+        for (int j = 0; j < 32; j += 8) i += (readByte() << j);
+        return i;
+    }
+    void writeByte(unsigned char c) {
+        if (Pk2Status.UpLoadFull) return;
+        buffer[write_index++] = c;
+        if (write_index == size) write_index = 0;
+        bytes_in++;
+        if (read_index == write_index) Pk2Status.UpLoadFull = 1;
+    }
+    unsigned char *writeBuffer(unsigned char *src) {
+        int count = *src++;
+        while (count--) writeByte(*src++);
+        return src;
+    }
+    void writeInt(unsigned i) {
+        for (int j = 0; j < 32; j += 8) writeByte(i >> j);
+    }
+    unsigned bytes_in, bytes_out;
+private:
+    unsigned char *buffer;
+    int size, read_index, write_index;
+};
+
+unsigned char old_download[260], old_upload[132];
+RingBufferManager old_down(old_download, sizeof old_download);
+RingBufferManager old_up(old_upload, sizeof old_upload);
+
+unsigned char new_download[DOWNLOAD_SIZE] __attribute__((aligned(4)));
+unsigned char new_upload[UPLOAD_SIZE] __attribute__((aligned(4)));
+RingBuffer<DownloadFlags> new_down;
+RingBuffer<UploadFlags> new_up;
+
+unsigned reports;
+unsigned char report[64];
+
+// CMD_DOWNLOAD_DATA of 15 words, then JT2_XFRFASTDAT_BUF taking them
+template <class Ring>
+unsigned download(Ring &r) {
+    unsigned sum = 0, i, j;
+    for (i = 0; i < reports; i++) {
+        report[0] = 60;
+        report[1] = i;
+        r.writeBuffer(report);
+        for (j = 0; j < 15; j++) sum = sum * 31 + r.readInt();
+    }
+    return sum;
+}
+
+// JT2_GET_PE_RESP results, then the CMD_UPLOAD_DATA report
+template <class Ring>
+unsigned upload(Ring &r) {
+    unsigned char buf[64];
+    unsigned sum = 0, i, j;
+    for (i = 0; i < reports; i++) {
+        for (j = 0; j < 16; j++) r.writeInt(i * 16 + j);
+        r.read2buffer(buf, 64);
+        for (j = 0; j < 64; j += 8) sum = sum * 31 + buf[j] + buf[j + 3];
+    }
+    return sum;
+}
+
+// Byte at a time, as the ICSP byte scripts use them
+template <class Ring>
+unsigned bytes(Ring &r) {
+    unsigned sum = 0, i, j;
+    for (i = 0; i < reports; i++) {
+        for (j = 0; j < 64; j++) r.writeByte(i + j);
+        for (j = 0; j < 64; j++) sum = sum * 31 + r.readByte();
+    }
+    return sum;
+}
+
+double ns_per_byte(unsigned (*f)(void), unsigned size, unsigned *sum) {
+    auto t = std::chrono::steady_clock::now();
+    *sum = f();
+    std::chrono::duration<double, std::nano> d = std::chrono::steady_clock::now() - t;
+    return d.count() / ((double)reports * size);
+}
+
+// size: bytes through the ring per report
+bool compare(const char *name, unsigned size, unsigned (*old)(void), unsigned (*now)(void)) {
+    unsigned a, b;
+    double t0 = ns_per_byte(old, size, &a), t1 = ns_per_byte(now, size, &b);
+    printf("%-10s %9.2f %9.2f %8.1fx\n", name, t0, t1, t0 / t1);
+    if (a != b) printf("%-10s the rings disagree\n", name);
+    return a == b;
+}
+
+}//anonymous
+
+int main(int argc, char **argv) {
+    bool ok = true;
+    unsigned i;
+    reports = argc > 1 ? atoi(argv[1]) : 1000000;
+    for (i = 2; i < 64; i++) report[i] = i * 7;
+    new_down.setBuffer(new_download, sizeof new_download);
+    new_up.setBuffer(new_upload, sizeof new_upload);
+    printf("%u reports, host ns per byte\n", reports);
+    printf("%-10s %9s %9s %9s\n", "pattern", "old", "template", "speedup");
+    ok &= compare("download", 60, []() { return download(old_down); }, []() { return download(new_down); });
+    ok &= compare("upload", 64, []() { return upload(old_up); }, []() { return upload(new_up); });
+    ok &= compare("bytes", 64, []() { return bytes(old_down); }, []() { return bytes(new_down); });
+    return !ok || Pk2Status.Status;
+}
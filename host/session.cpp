@@ -0,0 +1,104 @@
+// A pic32prog session against the target model: ICSP entry, chip erase,
+// PE load, programming through CMD_PROGRAM_ROWS, verify with
+// SCRIPT_JT2_PE_CRC32, then the PE again from the programmer's cache.
+// Prints the simulated time of each step.
+//
+//   session [config] [KB]      config 1 HID (default), 2 bulk; image 64 KB
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "pk2.h"
+#include "target.h"
+
+namespace {
+
+std::vector<unsigned> image;
+unsigned start;
+
+void begin(void) { start = sim::ticks(); }
+
+double end(const char *step, bool ok, double kb = 0) {
+    double ms = (double)(sim::ticks() - start) / SIM_TICKS_MS;
+    printf("%-20s %9.1f ms", step, ms);
+    if (kb) printf(" %9.1f KB/s", kb / ms * 1000);
+    printf("\n");
+    if (!ok) {
+        printf("%s failed\n", step);
+        exit(1);
+    }
+    return ms;
+}
+
+bool partition(unsigned download, unsigned upload) {
+    unsigned char r[64];
+    pk2::send({CMD_PARTITION, (unsigned char)download, (unsigned char)upload});
+    return pk2::reply(r) && !pk2::get32(r);
+}
+
+bool program(unsigned window) {
+    unsigned skipped;
+    if (pk2::program(TARGET_FLASH_BASE, image.data(), image.size(), window, &skipped)) return false;
+    printf("%-20s %9u rows skipped blank\n", "", skipped);
+    return true;
+}
+
+bool verify(void) {
+    return pk2::pe_crc32(TARGET_FLASH_BASE, image.size()) == pk2::crc32(image.data(), image.size());
+}
+
+// Caches the PE in slot 0: loader instructions, then the fast data.
+bool store_pe(const std::vector<unsigned> &loader, const std::vector<unsigned> &pe) {
+    std::vector<unsigned> words(loader);
+    unsigned char r[64];
+    unsigned i, k;
+    words.insert(words.end(), pe.begin(), pe.end());
+    pk2::send({CMD_CLEAR_DOWNLOAD_BUFFER, CMD_PE_STORE, 0, 1, 0,
+        (unsigned char)loader.size(), (unsigned char)(loader.size() >> 8),
+        (unsigned char)pe.size(), (unsigned char)(pe.size() >> 8)});
+    for (i = 0; i < words.size(); i += k) {
+        k = words.size() - i < 15 ? words.size() - i : 15;
+        bytes b = {CMD_DOWNLOAD_DATA, (unsigned char)(k * 4)};
+        for (unsigned j = 0; j < k; j++) pk2::put32(b, words[i + j]);
+        pk2::send(b);
+    }
+    pk2::send({CMD_PE_INFO, 0});
+    return pk2::reply(r) && (pk2::get32(r) == 0x45503233);
+}
+
+bool inject_pe(void) {
+    pk2::send({CMD_PE_INJECT, 0});
+    sim::drain(10000);
+    return !(pk2::status() & ICD_TIMEOUT);
+}
+
+}//anonymous
+
+int main(int argc, char **argv) {
+    int config = argc > 1 ? atoi(argv[1]) : 1;
+    unsigned kb = argc > 2 ? atoi(argv[2]) : 64, i, words = kb * 256;
+    std::vector<unsigned> loader = pk2::sample_loader(), pe = pk2::sample_pe(1024);
+    double total = 0;
+    for (i = 0; i < words; i++)         // code, then a blank tail
+        image.push_back(i < words * 3 / 4 ? i * 2654435761u ^ 0x5a5a5a5a : ~0u);
+    sim::boot(config);
+    target::attach();
+    printf("configuration %d, %u KB image\n", config, kb);
+    begin(); total += end("ICSP entry", pk2::enter_icsp());
+    begin(); total += end("erase", pk2::erase());
+    begin(); total += end("serial execution", pk2::serial_execution());
+    begin(); total += end("PE load", pk2::load_pe(loader, pe) && pk2::pe_version() == TARGET_PE_VERSION);
+    begin(); total += end("program", partition(12, 8) && program(4096), kb);
+    begin(); total += end("verify", verify(), kb);
+    printf("%-20s %9.1f ms\n", "session", total);
+    if (memcmp(image.data(), target::flash, words * 4)) {
+        printf("flash differs from the image\n");
+        return 1;
+    }
+    begin(); end("PE store", store_pe(loader, pe));
+    pk2::serial_execution();
+    begin(); end("PE inject", inject_pe() && pk2::pe_version() == TARGET_PE_VERSION);
+    printf("%u instructions, %u fast data words, %u PE commands, %u rows\n",
+        target::n.instructions, target::n.fast_words, target::n.pe_commands, target::n.rows);
+    return 0;
+}
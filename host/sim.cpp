@@ -0,0 +1,383 @@
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include "xc.h"
+
+// Firmware entry points and the EP1 queue counters of hid.cpp
+void init(void), pickit_init(void), ProcessIO(void), USBDeviceInit(void);
+void button(unsigned t);
+bool wait(unsigned i), TaskAdd(void (*fn)(unsigned t), unsigned period);
+unsigned char *HIDReportRxd(void);
+extern "C" void ctISR(void), _USB1Interrupt(void);
+extern volatile unsigned tx_done;
+extern unsigned tx_queued;
+
+sfr LATB, TRISB = {0xffff}, PORTB, ANSELB = {0xffff}, CNPUB, LATC, TRISC = {0xffff},
+    ANSELC = {0xffff};
+sfr IEC0, IEC1, IFS0, IFS1, IPC0, IPC7, INTCON;
+sfr U1STAT, U1EP0, U1EP1, U1EP2, U1ADDR, U1EIR, U1IR, U1IE, U1CON, U1PWRC;
+sfr U1BDTP1, U1BDTP2, U1BDTP3;
+sfr NVMCON, NVMKEY, NVMADDR, NVMDATA, NVMSRCADDR;
+
+enum { CLR = 1, SET, INV };
+const sfr_alias LATBCLR = {LATB, CLR}, LATBSET = {LATB, SET}, LATBINV = {LATB, INV};
+const sfr_alias TRISBCLR = {TRISB, CLR}, TRISBSET = {TRISB, SET};
+const sfr_alias LATCSET = {LATC, SET}, TRISCSET = {TRISC, SET};
+const sfr_alias ANSELBCLR = {ANSELB, CLR}, INTCONSET = {INTCON, SET};
+const sfr_alias NVMCONCLR = {NVMCON, CLR}, NVMCONSET = {NVMCON, SET};
+
+const __LATBbits_t LATBbits = {{LATB, 2, 1}, {LATB, 3, 1}, {LATB, 9, 1}};
+const __TRISBbits_t TRISBbits = {{TRISB, 2, 1}, {TRISB, 3, 1}};
+const __PORTBbits_t PORTBbits = {{PORTB, 8, 1}};
+const __CNPUBbits_t CNPUBbits = {{CNPUB, 8, 1}};
+const __LATCbits_t LATCbits = {{LATC, 0, 1}};
+const __TRISCbits_t TRISCbits = {{TRISC, 0, 1}};
+const __ANSELCbits_t ANSELCbits = {{ANSELC, 0, 1}};
+const __IEC0bits_t IEC0bits = {{IEC0, 0, 1}};
+const __IEC1bits_t IEC1bits = {{IEC1, 3, 1}};
+const __IFS0bits_t IFS0bits = {{IFS0, 0, 1}};
+const __IFS1bits_t IFS1bits = {{IFS1, 3, 1}};
+const __IPC0bits_t IPC0bits = {{IPC0, 2, 3}};
+const __IPC7bits_t IPC7bits = {{IPC7, 10, 3}};
+const __U1IRbits_t U1IRbits = {{U1IR, 0, 1}, {U1IR, 3, 1}, {U1IR, 7, 1}};
+const __U1CONbits_t U1CONbits = {{U1CON, 0, 1}, {U1CON, 1, 1}, {U1CON, 5, 1}};
+const __U1PWRCbits_t U1PWRCbits = {{U1PWRC, 0, 1}, {U1PWRC, 3, 1}};
+
+#define URSTIF      0x01
+#define TRNIF       0x08
+#define STALLIF     0x80
+#define PPBRST      0x02
+#define PKTDIS      0x20
+#define NVM_PAGE    1024
+#define NVM_ROW     128
+
+namespace sim {
+
+void (*target_pins)(const pins &p);
+bool (*target_pgd)(void);
+unsigned long long pgc_edges;
+bool pressed;
+
+}
+
+namespace {
+
+unsigned long long cycle;       // SYSCLK
+unsigned compare;               // core timer Compare
+bool ie;                        // Status.IE
+bool in_isr;
+unsigned nvm_key;               // unlock writes seen
+unsigned long long busy;
+
+// SIE
+struct bd {                     // as usb_device.cpp lays out the BDT
+    unsigned char stat, pad;
+    unsigned short count;
+    unsigned char *buf;
+};
+enum { PID_OUT = 1, PID_IN = 9, PID_SETUP = 13 };
+enum { ACK, NAK, STALL };
+std::deque<unsigned> stat_fifo;  // U1STAT values, 4 deep
+unsigned ppbi[2][2];            // next even / odd BDT per endpoint and direction
+int config;                     // set by boot()
+unsigned next_slot;             // tick of the next EP1 transaction slot
+bool slot_in;                   // bulk: IN's turn
+std::deque<std::vector<unsigned char> > out_q, in_q;
+
+void advance(unsigned n);
+
+void dispatch(void) {
+    if (!ie || in_isr) return;
+    in_isr = true;
+    if ((IFS0.v & 1) && (IEC0.v & 1)) ctISR();
+    if (U1IR.v & U1IE.v) IFS1.v |= 8;
+    if ((IFS1.v & 8) && (IEC1.v & 8)) _USB1Interrupt();
+    in_isr = false;
+}
+
+// Rows and pages are host memory: the firmware's flash arrays sit below
+// 512 MB in a non-PIE build, so a physical address is the pointer.
+unsigned char *phys(unsigned address) { return (unsigned char *)(uintptr_t)address; }
+
+void nvm(void) {
+    unsigned char *p = phys(NVMADDR.v), *s = phys(NVMSRCADDR.v);
+    unsigned t, i;
+    NVMCON.v &= ~(_NVMCON_WRERR_MASK | _NVMCON_LVDERR_MASK);
+    if (nvm_key != 2 || !(NVMCON.v & _NVMCON_WREN_MASK)) {
+        NVMCON.v |= _NVMCON_WRERR_MASK;
+        return;
+    }
+    switch (NVMCON.v & 15) {
+        case 1:                 // word
+            for (i = 0; i < 4; i++) p[i] &= NVMDATA.v >> (i * 8);
+            t = 40; break;
+        case 3:                 // row
+            for (i = 0; i < NVM_ROW; i++) p[i] &= s[i];
+            t = 1500; break;
+        case 4:                 // page erase
+            memset(phys(NVMADDR.v & ~(NVM_PAGE - 1)), 0xff, NVM_PAGE);
+            t = 20000; break;
+        default:
+            NVMCON.v |= _NVMCON_WRERR_MASK;
+            return;
+    }
+    advance(t * (SIM_SYSCLK / 1000000));    // the CPU stalls on flash
+}
+
+void pins_changed(unsigned old_latb) {
+    sim::pins p;
+    if ((LATB.v ^ old_latb) & 4) sim::pgc_edges++;
+    p.pgc = LATB.v & 4;
+    p.pgd = LATB.v & 8;
+    p.pgd_out = !(TRISB.v & 8);
+    p.mclr = (TRISC.v & 1) || (LATC.v & 1);
+    if (sim::target_pins) sim::target_pins(p);
+}
+
+bd *bdt(void) {
+    return (bd *)phys(U1BDTP3.v << 24 | U1BDTP2.v << 16 | U1BDTP1.v << 8);
+}
+
+void stat_push(unsigned stat) {
+    stat_fifo.push_back(stat);
+    if (stat_fifo.size() == 1) {
+        U1STAT.v = stat;
+        U1IR.v |= TRNIF;
+    }
+}
+
+// One token from the host; n is the length sent, or received for IN.
+int token(int ep, int pid, unsigned char *data, int &n) {
+    int dir = pid == PID_IN, i = ep * 4 + dir * 2 + ppbi[ep][dir];
+    unsigned en = ep ? U1EP1.v : U1EP0.v;
+    bd &b = bdt()[i];
+    if (!(en & (dir ? 4 : 8))) return STALL;
+    if (((U1CON.v & PKTDIS) && pid != PID_SETUP) || (stat_fifo.size() == 4)) return NAK;
+    if (!(b.stat & 0x80)) return NAK;
+    if ((b.stat & 4) && (pid != PID_SETUP)) {
+        U1IR.v |= STALLIF;
+        return STALL;
+    }
+    if (dir) {
+        n = b.count;
+        memcpy(data, b.buf, n);
+    } else {
+        if (n > b.count) n = b.count;
+        memcpy(b.buf, data, n);
+        b.count = n;
+    }
+    b.stat = (b.stat & 0x40) | pid << 2;
+    ppbi[ep][dir] ^= 1;
+    if (pid == PID_SETUP) U1CON.v |= PKTDIS;
+    stat_push(i << 2);
+    return ACK;
+}
+
+bool out1(void) {
+    int n;
+    if (out_q.empty()) return false;
+    n = out_q.front().size();
+    if (token(1, PID_OUT, out_q.front().data(), n) != ACK) return false;
+    out_q.pop_front();
+    return true;
+}
+
+bool in1(void) {
+    std::vector<unsigned char> r(64);
+    int n;
+    if (token(1, PID_IN, r.data(), n) != ACK) return false;
+    r.resize(n);
+    in_q.push_back(r);
+    return true;
+}
+
+// EP1 traffic due by now. The SIE works through BDTs the CPU has handed
+// over, so transactions go on while the CPU is busy or stalled.
+void bus(void) {
+    unsigned now = cycle / 2;
+    while (config && (int)(now - next_slot) >= 0) {
+        if (config == 1) {              // interrupt endpoints, once a frame
+            next_slot += SIM_TICKS_MS;
+            out1();
+            in1();
+        } else {                        // bulk, alternating when both wait
+            next_slot += SIM_TICKS_MS / BULK_PER_FRAME;
+            if (slot_in || out_q.empty()) in1() || out1();
+            else out1() || in1();
+            slot_in = !slot_in;
+        }
+    }
+}
+
+void advance(unsigned n) {
+    unsigned before = cycle / 2, now;
+    cycle += n;
+    now = cycle / 2;
+    if (now - compare < now - before) IFS0.v |= 1;  // Count passed Compare
+    bus();
+    dispatch();
+}
+
+unsigned read(sfr &r) {
+    advance(SIM_READ_CYCLES);
+    if (&r == &PORTB) {
+        r.v = (LATB.v & ~TRISB.v) | (TRISB.v & (sim::pressed ? 0 : 0x100));  // RB8 pulled up
+        if ((TRISB.v & 8) && sim::target_pgd && sim::target_pgd()) r.v |= 8;
+    }
+    return r.v;
+}
+
+void write(sfr &r, unsigned x, unsigned mask) {
+    unsigned old = r.v;
+    if (&r == &U1IR) {                  // write 1 to clear
+        r.v &= ~(x & mask);
+        if ((old & ~r.v & TRNIF) && !stat_fifo.empty()) {
+            stat_fifo.pop_front();
+            if (!stat_fifo.empty()) {
+                U1STAT.v = stat_fifo.front();
+                U1IR.v |= TRNIF;
+            }
+        }
+    } else r.v = (r.v & ~mask) | (x & mask);
+    if (&r == &NVMKEY) nvm_key = (x == 0xAA996655) ? 1 : (nvm_key == 1 && x == 0x556699AA) ? 2 : 0;
+    if ((&r == &NVMCON) && (r.v & ~old & _NVMCON_WR_MASK)) {
+        nvm();
+        nvm_key = 0;
+        NVMCON.v &= ~_NVMCON_WR_MASK;
+    }
+    if ((&r == &U1CON) && (r.v & PPBRST)) memset(ppbi, 0, sizeof ppbi);
+    if (&r == &LATB || &r == &TRISB || &r == &LATC || &r == &TRISC) pins_changed(&r == &LATB ? old : LATB.v);
+    advance(SIM_WRITE_CYCLES);
+}
+
+}//anonymous
+
+sfr::operator unsigned() { return read(*this); }
+
+unsigned sfr::operator=(unsigned x) {
+    write(*this, x, ~0u);
+    return x;
+}
+
+unsigned sfr_alias::operator=(unsigned x) const {
+    unsigned v = r.v;
+    write(r, op == CLR ? v & ~x : op == SET ? v | x : v ^ x, ~0u);
+    return x;
+}
+
+sfr_field::operator unsigned() const {
+    return (read(r) >> shift) & ((1u << width) - 1);
+}
+
+unsigned sfr_field::operator=(unsigned x) const {
+    write(r, x << shift, ((1u << width) - 1) << shift);
+    return x;
+}
+
+unsigned _CP0_GET_COUNT(void) {
+    advance(SIM_COUNT_CYCLES);
+    return cycle / 2;
+}
+
+unsigned _CP0_GET_COMPARE(void) { return compare; }
+void _CP0_SET_COMPARE(unsigned c) { compare = c; }
+
+unsigned __builtin_disable_interrupts(void) {
+    unsigned status = ie;
+    ie = false;
+    return status;
+}
+
+unsigned __builtin_enable_interrupts(void) {
+    unsigned status = ie;
+    ie = true;
+    dispatch();
+    return status;
+}
+
+namespace sim {
+
+unsigned long long cycles(void) { return cycle; }
+unsigned ticks(void) { return cycle / 2; }
+void spend(unsigned n) { advance(n); }
+
+bool control(const unsigned char *setup, unsigned char *data) {
+    unsigned char buf[8];
+    int length = setup[6] | setup[7] << 8, got = 0, n = 8;
+    if (token(0, PID_SETUP, (unsigned char *)setup, n) != ACK) return false;
+    dispatch();
+    if (setup[0] & 0x80) {
+        do {
+            if (token(0, PID_IN, buf, n) != ACK) return false;
+            dispatch();
+            memcpy(data + got, buf, n);
+            got += n;
+        } while ((n == 8) && (got < length));
+        n = 0;
+        if (token(0, PID_OUT, buf, n) != ACK) return false;
+    } else if (token(0, PID_IN, buf, n) != ACK) return false;
+    dispatch();
+    return true;
+}
+
+void boot(int c) {
+    unsigned char d[18];
+    const unsigned char get_device[8] = {0x80, 6, 0, 1, 0, 0, 18, 0};
+    const unsigned char set_address[8] = {0, 5, 1, 0, 0, 0, 0, 0};
+    unsigned char set_config[8] = {0, 9, 0, 0, 0, 0, 0, 0};
+    init();
+    pickit_init();
+    TaskAdd(button, 1);
+    USBDeviceInit();
+    U1IR.v |= URSTIF;                   // bus reset
+    dispatch();
+    control(get_device, d);
+    control(set_address, 0);
+    set_config[2] = c;
+    control(set_config, 0);
+    config = c;
+    next_slot = cycle / 2;
+}
+
+void send(const unsigned char *report, int length) {
+    out_q.push_back(std::vector<unsigned char>(report, report + length));
+}
+
+bool receive(unsigned char *report) {
+    if (in_q.empty()) return false;
+    memcpy(report, in_q.front().data(), in_q.front().size());
+    in_q.pop_front();
+    return true;
+}
+
+unsigned pending(void) { return out_q.size(); }
+unsigned received(void) { return in_q.size(); }
+
+void step(void) {
+    unsigned long long t;
+    wait(0);
+    if (!HIDReportRxd()) {
+        ProcessIO();
+        return;
+    }
+    t = cycle;
+    ProcessIO();
+    busy += cycle - t;
+}
+
+bool run(bool (*done)(void), unsigned ms) {
+    unsigned start = ticks();
+    while (!done())
+        if (ticks() - start > ms * SIM_TICKS_MS) return false;
+        else step();
+    return true;
+}
+
+bool drain(unsigned ms) {
+    return run([]() { return out_q.empty() && !HIDReportRxd() && tx_done == tx_queued; }, ms);
+}
+
+unsigned long long busy_cycles(void) { return busy; }
+
+}
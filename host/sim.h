@@ -0,0 +1,78 @@
+#ifndef _SIM_H    /* Guard against multiple inclusion */
+#define _SIM_H
+
+// Host simulation of the PIC32MX250 pieces the firmware touches: the SFRs
+// it uses, the core timer and interrupts, flash self-programming, the USB
+// SIE with its BDT and a USB host driving EP0 and EP1.
+//
+// Time only moves when the firmware touches an SFR or reads the core
+// timer, each access charged a fixed number of SYSCLK cycles. Figures are
+// repeatable, and a lower bound for the code between accesses.
+
+#define SIM_SYSCLK          40000000    // Hz
+#define SIM_TICKS_MS        20000       // core timer, SYSCLK / 2
+#define SIM_READ_CYCLES     4           // SFR read, through the peripheral bus
+#define SIM_WRITE_CYCLES    2           // SFR write
+#define SIM_COUNT_CYCLES    1           // mfc0 of Count
+
+// A special function register. Reads and writes go through the
+// simulation, so pins, interrupts and the SIE see them.
+struct sfr {
+    unsigned v;
+    operator unsigned();
+    unsigned operator=(unsigned x);
+};
+
+// The CLR / SET / INV alias of a register.
+struct sfr_alias {
+    sfr &r;
+    int op;
+    unsigned operator=(unsigned x) const;
+};
+
+// One field of a register, as REGbits.FIELD.
+struct sfr_field {
+    sfr &r;
+    unsigned shift, width;
+    operator unsigned() const;
+    unsigned operator=(unsigned x) const;
+};
+
+namespace sim {
+
+// Clock
+unsigned long long cycles(void);
+unsigned ticks(void);                   // core timer
+void spend(unsigned cycles);            // code cost the model does not see
+
+// Pins: PGC (RB2), PGD (RB3), MCLR/VPP (RC0). A target watches the host
+// side and drives PGD back while PGD is an input.
+struct pins {
+    bool pgc, pgd, pgd_out;             // pgd is the latch when pgd_out
+    bool mclr;                          // low: target held in reset
+};
+extern void (*target_pins)(const pins &p);
+extern bool (*target_pgd)(void);        // PGD as the target drives it
+extern unsigned long long pgc_edges;
+extern bool pressed;                    // the switch on RB8, to ground
+
+// USB host, on the simulated bus. Configuration 1 polls the EP1
+// interrupt endpoints once per 1 ms frame; configuration 2 runs bulk
+// transactions back to back, up to BULK_PER_FRAME a frame.
+#define BULK_PER_FRAME      19
+void boot(int config);                  // firmware init, reset, enumerate
+bool control(const unsigned char *setup, unsigned char *data);
+void send(const unsigned char *report, int length = 64);
+bool receive(unsigned char *report);    // next IN packet, false if none
+unsigned pending(void);                 // OUT packets not yet accepted
+unsigned received(void);                // IN packets waiting in receive()
+
+// Firmware main loop
+void step(void);                        // one wait(0) and ProcessIO()
+bool run(bool (*done)(void), unsigned ms);  // false on time out
+bool drain(unsigned ms);                // until sent and the device idle
+unsigned long long busy_cycles(void);   // spent in ProcessIO with a report
+
+}
+
+#endif /* _SIM_H */
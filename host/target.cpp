@@ -0,0 +1,355 @@
+#include <cstring>
+#include <deque>
+#include "target.h"
+
+// IR values, as pickit.cpp sends them
+#define MTAP_IDCODE     0x01
+#define MTAP_SW_MTAP    0x04
+#define MTAP_SW_ETAP    0x05
+#define MTAP_COMMAND    0x07
+#define ETAP_ADDRESS    0x08
+#define ETAP_DATA       0x09
+#define ETAP_CONTROL    0x0A
+#define ETAP_EJTAGBOOT  0x0C
+#define ETAP_NORMALBOOT 0x0D
+#define ETAP_FASTDATA   0x0E
+
+#define CONTROL_PRACC   (1 << 18)
+#define CONTROL_PRNW    (1 << 19)
+#define MCHP_KEY        0x4D434850  // "MCHP"
+#define IDCODE          0x04D06053
+#define DMSEG           0xFF200200
+#define DMSEG_FASTDATA  0xFF200000
+#define JR_T9           0x03200008  // pic32prog's jump into the PE loader
+
+namespace target {
+
+timing t = {2, 80000, 20000, 1500, 40};
+counts n;
+unsigned flash[TARGET_FLASH_SIZE / 4];
+
+}
+
+namespace {
+
+using target::t;
+using target::n;
+
+enum tap_state {
+    TLR, IDLE, SEL_DR, CAP_DR, SHIFT_DR, EX1_DR, PAUSE_DR, EX2_DR, UPD_DR,
+    SEL_IR, CAP_IR, SHIFT_IR, EX1_IR, PAUSE_IR, EX2_IR, UPD_IR
+};
+
+// next state for TMS 0, TMS 1
+const unsigned char tap_next[16][2] = {
+    {IDLE, TLR}, {IDLE, SEL_DR}, {CAP_DR, SEL_IR}, {SHIFT_DR, EX1_DR},
+    {SHIFT_DR, EX1_DR}, {PAUSE_DR, UPD_DR}, {PAUSE_DR, EX2_DR}, {SHIFT_DR, UPD_DR},
+    {IDLE, SEL_DR}, {CAP_IR, TLR}, {SHIFT_IR, EX1_IR}, {SHIFT_IR, EX1_IR},
+    {PAUSE_IR, UPD_IR}, {PAUSE_IR, EX2_IR}, {SHIFT_IR, UPD_IR}, {IDLE, SEL_DR}
+};
+
+enum cpu_state { RESET, RUN, DEBUG, LOADER, PE };
+
+// ICSP pins
+bool mclr, pgc, pgd_out, icsp;
+unsigned key, phase, tdi, tdo;
+
+// TAP
+unsigned state = TLR, ir = MTAP_IDCODE, width;
+unsigned long long sr;
+bool etap, boot;
+unsigned control, data;
+
+// Processor
+cpu_state cpu = RESET;
+bool pending, writing, jump, fast_pracc;
+unsigned pend_value, pend_address, ready_at, erase_end;
+std::deque<unsigned> out;       // PE responses not yet read
+
+struct {
+    unsigned phase, op, operand, address, left, row[256];
+} pe;
+
+struct {
+    unsigned phase, left;
+} loader;
+
+unsigned now(void) { return sim::ticks(); }
+unsigned us(unsigned u) { return u * (SIM_TICKS_MS / 1000); }
+bool due(unsigned at) { return (int)(now() - at) >= 0; }
+void busy(unsigned u) { ready_at = now() + us(u); }
+
+unsigned *word(unsigned address) {
+    address = (address & 0x1fffffff) - TARGET_FLASH_BASE;
+    return address < TARGET_FLASH_SIZE ? &target::flash[address >> 2] : 0;
+}
+
+void program(unsigned address, unsigned value) {
+    unsigned *w = word(address);
+    if (w) *w &= value;         // flash bits only clear
+}
+
+void erase(void) {
+    memset(target::flash, 0xff, sizeof target::flash);
+    n.erases++;
+}
+
+void respond(unsigned v) { out.push_back(v); }
+
+// One word from the host to the PE
+void pe_input(unsigned v) {
+    unsigned i, *w;
+    switch (pe.phase) {
+        case 0:
+            n.pe_commands++;
+            pe.op = v >> 16;
+            pe.operand = v & 0xffff;
+            pe.phase = 1;
+            if (pe.op == PE_CHIP_ERASE) {
+                erase();
+                busy(t.erase_us);
+                respond(PE_CHIP_ERASE << 16);
+                pe.phase = 0;
+            } else if (pe.op == PE_EXEC_VERSION) {
+                respond(PE_EXEC_VERSION << 16 | TARGET_PE_VERSION);
+                pe.phase = 0;
+            } else if ((pe.op > PE_EXEC_VERSION) || (pe.op == 2)) {
+                respond(pe.op << 16 | 0xffff);      // unknown command
+                pe.phase = 0;
+            }
+            return;
+        case 1:
+            pe.address = v;
+            pe.phase = 2;
+            pe.left = pe.operand ? pe.operand : TARGET_ROW_WORDS;
+            if (pe.op == PE_READ) {
+                respond(PE_READ << 16);
+                for (i = 0; i < pe.operand; i++) {
+                    w = word(pe.address + i * 4);
+                    respond(w ? *w : ~0u);
+                }
+                pe.phase = 0;
+            } else if (pe.op == PE_PAGE_ERASE) {
+                for (i = 0; i < pe.operand * TARGET_PAGE_SIZE; i += 4)
+                    if ((w = word((pe.address & ~(TARGET_PAGE_SIZE - 1)) + i))) *w = ~0u;
+                busy(t.page_us * pe.operand);
+                respond(PE_PAGE_ERASE << 16);
+                pe.phase = 0;
+            }
+            return;
+        default:
+            if (pe.op == PE_WORD_PROGRAM) {
+                program(pe.address, v);
+                busy(t.word_us);
+                respond(PE_WORD_PROGRAM << 16);
+            } else if (pe.op == PE_BLANK_CHECK) {
+                for (i = 0; i < v; i += 4)
+                    if ((w = word(pe.address + i)) && (*w != ~0u)) break;
+                respond(PE_BLANK_CHECK << 16 | (i < v));
+            } else {                            // PE_ROW_PROGRAM
+                pe.row[(pe.phase++ - 2) & 255] = v;
+                if (--pe.left) return;
+                for (i = 0; i < pe.phase - 2; i++) program(pe.address + i * 4, pe.row[i & 255]);
+                n.rows++;
+                busy(t.row_us);
+                respond(PE_ROW_PROGRAM << 16);
+            }
+            pe.phase = 0;
+    }
+}
+
+// One word from the host to the loader: {address} {count} {words}...,
+// then {0} {jump}.
+void loader_input(unsigned v) {
+    switch (loader.phase) {
+        case 0: loader.phase = v ? 1 : 3; break;
+        case 1: loader.left = v; loader.phase = v ? 2 : 0; break;
+        case 2: if (!--loader.left) loader.phase = 0; break;
+        default:
+            cpu = PE;
+            pe.phase = 0;
+            out.clear();
+    }
+}
+
+// The host completed the pending access; value is what a read got.
+void complete(unsigned value) {
+    pending = false;
+    busy(t.pracc_us);
+    if (writing) {
+        out.pop_front();
+        return;
+    }
+    switch (cpu) {
+        case DEBUG:
+            n.instructions++;
+            if (jump) {             // delay slot done, into the loader
+                cpu = LOADER;
+                loader.phase = 0;
+            }
+            jump = value == JR_T9;
+            break;
+        case LOADER:
+            n.fast_words++;
+            loader_input(value);
+            break;
+        case PE:
+            n.fast_words++;
+            pe_input(value);
+            break;
+        default:;
+    }
+}
+
+// Raise the next processor access once the processor is ready for it.
+void poll(void) {
+    if (pending || !due(ready_at)) return;
+    if (cpu == DEBUG) pend_address = DMSEG;
+    else if (cpu == LOADER) pend_address = DMSEG_FASTDATA;
+    else if (cpu == PE) pend_address = out.empty() ? DMSEG_FASTDATA : DMSEG;
+    else return;
+    writing = (cpu == PE) && !out.empty();
+    pend_value = writing ? out.front() : 0;
+    pending = true;
+}
+
+void reset_cpu(cpu_state s) {
+    cpu = s;
+    pending = jump = false;
+    ready_at = now();
+    out.clear();
+}
+
+void mchp_command(unsigned c) {
+    switch (c) {
+        case MCHP_ASSERT_RST: reset_cpu(RESET); break;
+        case MCHP_DE_ASSERT_RST: reset_cpu(boot ? DEBUG : RUN); break;
+        case MCHP_ERASE:
+            erase();
+            erase_end = now() + us(t.erase_us);
+            break;
+        default:;
+    }
+}
+
+unsigned mchp_status(void) {
+    return MCHP_CPS | (due(erase_end) ? MCHP_CFGRDY : MCHP_FCBUSY) |
+        (cpu == RESET ? MCHP_DEVRST : 0);
+}
+
+void capture_dr(void) {
+    width = 32;
+    if (!etap) {
+        if (ir == MTAP_COMMAND) {
+            width = 8;
+            sr = mchp_status();
+        } else if (ir == MTAP_IDCODE) sr = IDCODE;
+        else width = 1, sr = 0;
+        return;
+    }
+    poll();
+    switch (ir) {
+        case MTAP_IDCODE: sr = IDCODE; break;
+        case ETAP_ADDRESS: sr = pend_address; break;
+        case ETAP_DATA: sr = pending && writing ? pend_value : data; break;
+        case ETAP_CONTROL:
+            sr = (control & ~(CONTROL_PRACC | CONTROL_PRNW)) |
+                (pending ? CONTROL_PRACC : 0) | (pending && writing ? CONTROL_PRNW : 0);
+            break;
+        case ETAP_FASTDATA:     // PrAcc, then the word
+            width = 33;
+            sr = fast_pracc = pending && !writing && (pend_address == DMSEG_FASTDATA);
+            break;
+        default: width = 1, sr = 0;
+    }
+}
+
+void update_dr(void) {
+    if (!etap) {
+        if (ir == MTAP_COMMAND) mchp_command(sr & 0xff);
+        return;
+    }
+    switch (ir) {
+        case ETAP_DATA: data = sr; break;
+        case ETAP_CONTROL:
+            control = sr;
+            if (pending && !(sr & CONTROL_PRACC)) complete(data);
+            break;
+        case ETAP_FASTDATA:     // completes the read PrAcc was captured for
+            if (fast_pracc) complete(sr >> 1);
+            break;
+        default:;
+    }
+}
+
+void update_ir(void) {
+    ir = sr & 0x1f;
+    if (ir == MTAP_SW_MTAP) etap = false;
+    else if (ir == MTAP_SW_ETAP) etap = true;
+    else if (etap && (ir == ETAP_EJTAGBOOT)) boot = true;
+    else if (etap && (ir == ETAP_NORMALBOOT)) boot = false;
+}
+
+// One TCK: the action of the current state, then the move.
+void clock(unsigned tdi, unsigned tms) {
+    switch (state) {
+        case CAP_DR: capture_dr(); break;
+        case CAP_IR: sr = 1; width = 5; break;
+        case SHIFT_DR:
+        case SHIFT_IR: sr = (sr >> 1) | ((unsigned long long)tdi << (width - 1)); break;
+        default:;
+    }
+    state = tap_next[state][tms];
+    if (state == UPD_DR) update_dr();
+    else if (state == UPD_IR) update_ir();
+    else if (state == TLR) ir = MTAP_IDCODE;
+    tdo = ((state == SHIFT_DR) || (state == SHIFT_IR)) ? sr & 1 : 0;
+}
+
+// Each 2-wire bit starts when the programmer takes PGD: TDI is latched
+// at the end of the first PGC period and TMS, which clocks the TAP, at
+// the end of the second. The target drives TDO in the fourth.
+void pins(const sim::pins &p) {
+    if (p.mclr != mclr) {
+        mclr = p.mclr;
+        if (!mclr) {
+            key = 0;
+            icsp = false;
+            reset_cpu(RESET);
+        } else {
+            icsp = key == MCHP_KEY;
+            state = TLR;
+            ir = MTAP_IDCODE;
+            etap = boot = false;
+            reset_cpu(RUN);
+        }
+    }
+    if (!mclr) {
+        if (p.pgc && !pgc && p.pgd_out) key = key << 1 | p.pgd;
+    } else if (icsp) {
+        if (p.pgd_out && !pgd_out) phase = 0;
+        if (pgc && !p.pgc) {
+            if (++phase == 1) tdi = p.pgd;
+            else if (phase == 2) clock(tdi, p.pgd);
+        }
+    }
+    pgc = p.pgc;
+    pgd_out = p.pgd_out;
+}
+
+bool pgd(void) { return icsp && tdo; }
+
+}//anonymous
+
+namespace target {
+
+void attach(void) {
+    memset(flash, 0xff, sizeof flash);
+    sim::target_pins = pins;
+    sim::target_pgd = pgd;
+}
+
+bool in_icsp(void) { return icsp; }
+bool in_pe(void) { return cpu == PE; }
+
+}
@@ -0,0 +1,67 @@
+#ifndef _TARGET_H    /* Guard against multiple inclusion */
+#define _TARGET_H
+
+// A PIC32MX target on the simulated ICSP pins: 2-wire entry with the
+// MCHP key, the MTAP and ETAP behind a 4-phase TAP, processor accesses
+// (PrAcc) for serial execution and fast data, the pic32prog PE loader
+// and a programming executive working on a flash array.
+//
+// Processor accesses and flash operations take simulated time, so a
+// slow target can be dialled in to drive the programmer's timeouts.
+
+#include "sim.h"
+
+#define TARGET_FLASH_BASE   0x1D000000  // physical
+#define TARGET_FLASH_SIZE   0x20000     // PIC32MX250F128
+#define TARGET_PAGE_SIZE    1024
+#define TARGET_ROW_WORDS    32
+#define TARGET_PE_VERSION   0x0301
+
+// PE commands, {opcode:16 operand:16}
+#define PE_ROW_PROGRAM      0x0000  // spelled as in pickit.cpp, built into some tools
+#define PE_READ             0x0001
+#define PE_WORD_PROGRAM     3
+#define PE_CHIP_ERASE       4
+#define PE_PAGE_ERASE       5
+#define PE_BLANK_CHECK      6
+#define PE_EXEC_VERSION     7
+
+// MTAP_COMMAND data
+#define MCHP_STATUS         0x00
+#define MCHP_ASSERT_RST     0xD1
+#define MCHP_DE_ASSERT_RST  0xD0
+#define MCHP_ERASE          0xFC
+#define MCHP_FLASH_ENABLE   0xFE
+#define MCHP_CPS            0x80    // status: not code protected
+#define MCHP_CFGRDY         0x08
+#define MCHP_FCBUSY         0x04
+#define MCHP_DEVRST         0x01
+
+namespace target {
+
+struct timing {
+    unsigned pracc_us;      // between processor accesses
+    unsigned erase_us;      // chip erase, MTAP or PE
+    unsigned page_us;       // page erase
+    unsigned row_us;        // row program
+    unsigned word_us;       // word program
+};
+extern timing t;            // defaults of a PIC32MX250 at 40 MHz
+
+struct counts {
+    unsigned instructions;  // executed in serial execution mode
+    unsigned fast_words;    // taken through FASTDATA
+    unsigned pe_commands;
+    unsigned rows, erases;
+};
+extern counts n;
+
+extern unsigned flash[TARGET_FLASH_SIZE / 4];
+
+void attach(void);          // on the sim pins, flash erased
+bool in_icsp(void);         // MCHP key taken
+bool in_pe(void);           // the PE is running
+
+}
+
+#endif /* _TARGET_H */
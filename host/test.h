@@ -0,0 +1,16 @@
+#ifndef _TEST_H    /* Guard against multiple inclusion */
+#define _TEST_H
+
+// Checks for the host tests: each failure is reported and counted, and
+// main returns the count through DONE().
+
+#include <cstdio>
+
+static int failures;
+
+#define CHECK(c) ((c) ? (void)0 : \
+    (void)(fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #c), failures++))
+
+#define DONE() (printf("%s: %s\n", __FILE__, failures ? "FAIL" : "ok"), failures != 0)
+
+#endif /* _TEST_H */
@@ -0,0 +1,69 @@
+// SCRIPT_DELAY_SHORT and SCRIPT_DELAY_LONG against the core timer: PGC
+// is raised before the delay and dropped after it, and the time between
+// the two edges checked against 42.7 us and 5.46 ms a unit. USB OUT
+// reports sent behind the script are taken while it waits.
+
+#include <cstdio>
+#include "pk2.h"
+#include "test.h"
+
+#define TICKS_US        (SIM_TICKS_MS / 1000)
+#define SLACK_TICKS     (1 * TICKS_US)      // the ops around the delay
+
+namespace {
+
+bool pgc;
+unsigned rise, fall, taken;
+
+void record(const sim::pins &p) {
+    if (p.pgc && !pgc) rise = sim::ticks();
+    if (!p.pgc && pgc) {
+        fall = sim::ticks();
+        taken = sim::pending();
+    }
+    pgc = p.pgc;
+}
+
+// The ticks PGC stayed high around the delay
+unsigned measure(unsigned char op, unsigned char units) {
+    pk2::script({SCRIPT_SET_ICSP_PINS, 4, op, units, SCRIPT_SET_ICSP_PINS, 0});
+    return fall - rise;
+}
+
+void check(const char *name, unsigned char op, unsigned char units, unsigned unit) {
+    unsigned ticks = measure(op, units), want = units * unit;
+    printf("%-12s %3u  %10.2f us  %+6.2f us\n", name, units, ticks / (double)TICKS_US,
+        ((int)ticks - (int)want) / (double)TICKS_US);
+    CHECK(ticks >= want);
+    CHECK(ticks <= want + SLACK_TICKS);
+}
+
+}//anonymous
+
+int main() {
+    unsigned char script[64] = {CMD_EXECUTE_SCRIPT, 6, SCRIPT_SET_ICSP_PINS, 4,
+        SCRIPT_DELAY_LONG, 20, SCRIPT_SET_ICSP_PINS, 0};
+    unsigned char version[64] = {CMD_GET_VERSION}, r[64];
+    sim::boot(1);
+    sim::target_pins = record;
+    pk2::script({SCRIPT_SET_ICSP_PINS, 0});
+
+    check("DELAY_SHORT", SCRIPT_DELAY_SHORT, 1, 854);
+    check("DELAY_SHORT", SCRIPT_DELAY_SHORT, 3, 854);
+    check("DELAY_SHORT", SCRIPT_DELAY_SHORT, 47, 854);
+    check("DELAY_SHORT", SCRIPT_DELAY_SHORT, 255, 854);
+    check("DELAY_LONG", SCRIPT_DELAY_LONG, 1, 109200);
+    check("DELAY_LONG", SCRIPT_DELAY_LONG, 20, 109200);
+
+    // the reports behind a 109 ms delay are in by the time it ends, and
+    // answered after it
+    sim::send(script);
+    sim::send(version);
+    sim::send(version);
+    sim::drain(1000);
+    CHECK(fall - rise >= 20 * 109200);
+    CHECK(taken == 0);
+    CHECK(sim::receive(r) && (r[0] == 2));
+    CHECK(sim::receive(r) && (r[0] == 2));
+    return DONE();
+}
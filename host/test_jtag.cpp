@@ -0,0 +1,69 @@
+// The unrolled EJTAG scans against jtag2w4ph: the same PGC/PGD sequence,
+// pin change for pin change. pickit.cpp is built into the test, so the
+// scans inside its anonymous namespace can be reached.
+
+#include <vector>                // ahead of the firmware's vector macro
+#include "../pickit.cpp"
+#include "sim.h"
+#include "test.h"
+
+namespace {
+
+std::vector<unsigned> pins_log;
+
+// Records each change of PGC, the PGD latch and the PGD direction.
+void record(const sim::pins &p) {
+    unsigned s = p.pgc | p.pgd << 1 | p.pgd_out << 2;
+    if (pins_log.empty() || (pins_log.back() != s)) pins_log.push_back(s);
+}
+
+template <typename F>
+std::vector<unsigned> scan(F f) {
+    pins_log.clear();
+    f();
+    return pins_log;
+}
+
+template <unsigned command>
+void send_cmd(void) {
+    std::vector<unsigned> a = scan([]() { P32SendCmd<command>(); });
+    CHECK(a == scan([]() { P32SendCommand(command); }));
+    CHECK(a.size() > 11 * 8);
+}
+
+}//anonymous
+
+int main() {
+    unsigned char script[2] = {SCRIPT_JT2_SENDCMD, 0};
+    op o[2];
+    unsigned i;
+    sim::boot(1);
+    sim::target_pins = record;
+
+    send_cmd<MTAP_SW_MTAP>();
+    send_cmd<MTAP_SW_ETAP>();
+    send_cmd<MTAP_COMMAND>();
+    send_cmd<ETAP_ADDRESS>();
+    send_cmd<ETAP_DATA>();
+    send_cmd<ETAP_CONTROL>();
+    send_cmd<ETAP_EJTAGBOOT>();
+    send_cmd<ETAP_FASTDATA>();
+    CHECK(scan([]() { P32SetModeFixed<5, 0x1f>(); }) == scan([]() { P32SetMode(5, 0x1f); }));
+    CHECK(scan([]() { P32SetModeFixed<6, 0x1f>(); }) == scan([]() { P32SetMode(6, 0x1f); }));
+    CHECK(scan([]() { P32WriteData32<0xc000>(); }) == scan([]() { P32XferData32(0xc000); }));
+    CHECK(scan([]() { P32WriteData32<0x89abcdef>(); }) == scan([]() { P32XferData32(0x89abcdef); }));
+
+    // the script decoder hands each named instruction its unrolled scan
+    for (i = 0; i < sizeof(fixed_command) / sizeof(*fixed_command); i++) {
+        script[1] = fixed_command[i].command;
+        decodeScript(script, sizeof script, o);
+        CHECK(o[0].fn == fixed_command[i].fn);
+        CHECK(scan([&]() { o[0].fn(o); }) == scan([&]() { P32SendCommand(script[1]); }));
+    }
+
+    // a paced clock takes the jtag2w4ph path
+    icsp_half = 10;
+    CHECK(scan([]() { P32SendCmd<ETAP_DATA>(); }) == scan([]() { P32SendCommand(ETAP_DATA); }));
+    icsp_half = 0;
+    return DONE();
+}
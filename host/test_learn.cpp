@@ -0,0 +1,80 @@
+// PK2GO: a programming session recorded in learn mode, then replayed
+// from the switch with no host, into a blank target. The replay has no
+// credits to pace it, so the firmware must hold the recorded downloads
+// until the row job has room for them.
+
+#include <cstring>
+#include "pk2.h"
+#include "target.h"
+#include "test.h"
+
+#define STATUS_LEARN_FULL   0x0080      // Pk2Status.LearnOvrFlow
+#define STATUS_ERRORS       0xFE00      // Pk2Status.ERRMASK
+
+namespace {
+
+void idle(unsigned ms) { sim::run([]() { return false; }, ms); }
+
+void configure(unsigned char config) {
+    const unsigned char set_config[8] = {0, 9, config, 0, 0, 0, 0, 0};
+    sim::control(set_config, 0);
+}
+
+void press(void) {
+    sim::pressed = true;
+    idle(50);
+    sim::pressed = false;
+}
+
+bool blank(void) {
+    for (unsigned w : target::flash)
+        if (w != ~0u) return false;
+    return true;
+}
+
+}//anonymous
+
+int main() {
+    std::vector<unsigned> image(16 * 32);
+    unsigned i;
+    for (i = 0; i < image.size(); i++) image[i] = i * 0x9E3779B9;
+    sim::boot(1);
+    target::attach();
+
+    // record, at the 256 byte default download buffer
+    pk2::send({CMD_ENTER_LEARN_MODE, 0x50, 0x4B, 0x32, 0});
+    CHECK(pk2::enter_icsp());
+    CHECK(pk2::erase());
+    CHECK(pk2::serial_execution());
+    CHECK(pk2::load_pe(pk2::sample_loader(), pk2::sample_pe(256)));
+    CHECK(pk2::program(TARGET_FLASH_BASE, image.data(), image.size(), 256) == 0);
+    pk2::send({CMD_EXIT_LEARN_MODE, CMD_ENABLE_PK2GO_MODE, 0x50, 0x4B, 0x32, 0});
+    sim::drain(1000);
+    CHECK(!memcmp(target::flash, image.data(), image.size() * 4));
+    CHECK(!(pk2::status() & (STATUS_LEARN_FULL | STATUS_ERRORS)));
+
+    // with a host attached the switch does not start a replay
+    target::attach();
+    press();
+    idle(3000);
+    CHECK(blank());
+
+    // a line station: nothing configured, a blank target, the switch
+    configure(0);
+    press();
+    idle(20000);
+    CHECK(!memcmp(target::flash, image.data(), image.size() * 4));
+    CHECK(target::n.rows == 2 * image.size() / 32);
+    configure(1);
+    CHECK(!(pk2::status() & STATUS_ERRORS));
+
+    // running out of learn space has its own status bit
+    pk2::send({CMD_ENTER_LEARN_MODE, 0x50, 0x4B, 0x32, 0});
+    for (i = 0; i < 1100; i++) pk2::send({CMD_NO_OPERATION});
+    pk2::send({CMD_EXIT_LEARN_MODE});
+    sim::drain(60000);
+    i = pk2::status();
+    CHECK(i & STATUS_LEARN_FULL);
+    CHECK(!(i & STATUS_ERRORS));
+    return DONE();
+}
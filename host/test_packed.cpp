@@ -0,0 +1,83 @@
+// CMD_DOWNLOAD_PACKED round trip: the host encoder against a reference
+// decoder, then through the firmware's expansion into CMD_PROGRAM_ROWS
+// and the target's flash, with blank rows skipped.
+
+#include <algorithm>
+#include <cstring>
+#include "pk2.h"
+#include "target.h"
+#include "test.h"
+
+namespace {
+
+// The records back into bytes, as the header in pickit.h lays them out
+bytes unpack(const std::vector<pk2::chunk> &reports) {
+    bytes out;
+    unsigned i, n, k;
+    for (const pk2::chunk &c : reports) {
+        const unsigned char *p = c.report.data() + 2, *end = p + c.report[1];
+        CHECK(c.report[0] == CMD_DOWNLOAD_PACKED);
+        CHECK(c.report.size() <= 64);
+        k = out.size();
+        while (p < end) {
+            n = *p;
+            if (n < 0x80) {
+                out.insert(out.end(), p + 1, p + n + 2);
+                p += n + 2;
+            } else if (n < 0xc0) {
+                out.insert(out.end(), (n & 0x3f) + 3, p[1]);
+                p += 2;
+            } else {
+                out.insert(out.end(), ((n & 0x3f) << 16 | p[2] << 8 | p[1]) + 1, 0xff);
+                p += 3;
+            }
+        }
+        CHECK(p == end);
+        CHECK(out.size() - k == c.expanded);
+    }
+    return out;
+}
+
+unsigned size(const std::vector<pk2::chunk> &reports) {
+    unsigned n = 0;
+    for (const pk2::chunk &c : reports) n += c.report.size();
+    return n;
+}
+
+}//anonymous
+
+int main() {
+    const unsigned ROW = TARGET_ROW_WORDS * 4, ROWS = 1024;
+    std::vector<unsigned char> image(ROWS * ROW, 0xff);
+    std::vector<pk2::chunk> packed;
+    unsigned i, skipped, blank = 0;
+
+    // code, a zero filled table, a row blank but for one word, and a
+    // 96 KB blank gap before the last rows
+    for (i = 0; i < 64 * ROW; i++) image[i] = i * 2654435761u >> 13;
+    memset(&image[64 * ROW], 0, 32 * ROW);
+    memset(&image[96 * ROW + 40], 0x5a, 4);
+    for (i = 1000 * ROW; i < ROWS * ROW; i++) image[i] = i * 40503u >> 7;
+    for (i = 0; i < ROWS; i++)
+        if (std::count(&image[i * ROW], &image[(i + 1) * ROW], 0xff) == (int)ROW) blank++;
+
+    packed = pk2::pack(image.data(), image.size());
+    CHECK(unpack(packed) == image);
+    CHECK(size(packed) * 8 < image.size());
+    CHECK(unpack(pk2::pack("\xff\xff\x01\x01\x01\x02", 6)) == bytes({0xff, 0xff, 1, 1, 1, 2}));
+
+    sim::boot(1);
+    target::attach();
+    CHECK(pk2::enter_icsp());
+    CHECK(pk2::erase());
+    CHECK(pk2::serial_execution());
+    CHECK(pk2::load_pe(pk2::sample_loader(), pk2::sample_pe(256)));
+
+    // a blank record far larger than the download buffer is held, not lost
+    CHECK(pk2::program(TARGET_FLASH_BASE, packed, ROWS, 256, &skipped) == 0);
+    CHECK(skipped == blank);
+    CHECK(!memcmp(target::flash, image.data(), image.size()));
+    CHECK(target::n.rows == ROWS - blank);
+    CHECK(!(pk2::status() & ICD_TIMEOUT));
+    return DONE();
+}
@@ -0,0 +1,72 @@
+// Script loops: a jump out of a loop body drops the loop, so a loop left
+// on every pass of an outer one neither fills the loop stack nor aborts
+// the script; nesting past LOOP_DEPTH aborts with EmptyScript. PGC rises
+// count the passes.
+
+#include "pk2.h"
+#include "test.h"
+
+#define STATUS_EMPTY_SCRIPT 0x2000      // Pk2Status.EmptyScript
+
+namespace {
+
+bool pgc;
+unsigned rises;
+
+void record(const sim::pins &p) {
+    if (p.pgc && !pgc) rises++;
+    pgc = p.pgc;
+}
+
+unsigned passes(const bytes &ops) {
+    rises = 0;
+    pk2::script(ops);
+    return rises;
+}
+
+}//anonymous
+
+int main() {
+    sim::boot(1);
+    sim::target_pins = record;
+    pk2::script({SCRIPT_SET_ICSP_PINS, 0});
+
+    // 20 passes, each entering the inner loop at its LOOP op and leaving
+    // its body by GOTO_INDEX, then PGC raised once more at the end
+    CHECK(passes({SCRIPT_SET_ICSP_PINS, 0,
+        SCRIPT_SET_ICSP_PINS, 4,            // 2: outer body
+        SCRIPT_SET_ICSP_PINS, 0,
+        SCRIPT_GOTO_INDEX, 4,               // 6: to the inner LOOP
+        SCRIPT_GOTO_INDEX, 5,               // 8: inner body, out to 13
+        SCRIPT_LOOP, 2, 5,                  // 10: inner, back to 8
+        SCRIPT_LOOP, 11, 19,                // 13: outer, back to 2
+        SCRIPT_SET_ICSP_PINS, 4}) == 21);
+    CHECK(!(pk2::status() & STATUS_EMPTY_SCRIPT));
+
+    // LOOP_DEPTH loops, each entered from inside the one around it
+    pk2::script({SCRIPT_GOTO_INDEX, 18,
+        SCRIPT_GOTO_INDEX, 13,
+        SCRIPT_GOTO_INDEX, 8,
+        SCRIPT_GOTO_INDEX, 3,
+        SCRIPT_EXIT_SCRIPT,                 // 8: innermost body
+        SCRIPT_LOOP, 1, 1,
+        SCRIPT_LOOP, 6, 1,
+        SCRIPT_LOOP, 11, 1,
+        SCRIPT_LOOP, 16, 1});
+    CHECK(!(pk2::status() & STATUS_EMPTY_SCRIPT));
+
+    // and one more
+    pk2::script({SCRIPT_GOTO_INDEX, 23,
+        SCRIPT_GOTO_INDEX, 18,
+        SCRIPT_GOTO_INDEX, 13,
+        SCRIPT_GOTO_INDEX, 8,
+        SCRIPT_GOTO_INDEX, 3,
+        SCRIPT_EXIT_SCRIPT,                 // 10: innermost body
+        SCRIPT_LOOP, 1, 1,
+        SCRIPT_LOOP, 6, 1,
+        SCRIPT_LOOP, 11, 1,
+        SCRIPT_LOOP, 16, 1,
+        SCRIPT_LOOP, 21, 1});
+    CHECK(pk2::status() & STATUS_EMPTY_SCRIPT);
+    return DONE();
+}
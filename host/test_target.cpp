@@ -0,0 +1,118 @@
+// The target model against the firmware: a program and verify round
+// trip, then a slow target driving each ICDTimeOut path.
+
+#include <cstring>
+#include "pk2.h"
+#include "target.h"
+#include "test.h"
+
+#define ETAP_FASTDATA   0x0E
+
+namespace {
+
+void idle(unsigned ms) { sim::run([]() { return false; }, ms); }
+
+unsigned pracc_timeouts(void) {
+    unsigned char r[64];
+    pk2::send({CMD_READ_PRACC_STATS});
+    return pk2::reply(r) ? r[0] | r[1] << 8 : ~0u;
+}
+
+// Each wait since the last read is in both histograms,
+// {polls[1..15]} and {us[16]}, once
+bool pracc_waits_agree(void) {
+    unsigned char r[64];
+    unsigned polls = 0, us = 0, i;
+    pk2::send({CMD_READ_PRACC_STATS});
+    if (!pk2::reply(r)) return false;
+    for (i = 2; i < 32; i += 2) polls += r[i] | r[i + 1] << 8;
+    for (i = 32; i < 64; i += 2) us += r[i] | r[i + 1] << 8;
+    return polls && (polls == us);
+}
+
+// The response left in the PE by a timed out wait
+unsigned late_response(void) {
+    bytes b = pk2::run({SCRIPT_JT2_GET_PE_RESP});
+    return b.size() == 4 ? pk2::get32(b.data()) : ~0u;
+}
+
+}//anonymous
+
+int main() {
+    std::vector<unsigned> image(8 * 32), flash;
+    unsigned char r[64];
+    unsigned i;
+    for (i = 0; i < image.size(); i++) image[i] = i * 0x01000193;
+    sim::boot(1);
+    target::attach();
+    CHECK(pk2::enter_icsp());
+    CHECK(pk2::erase());
+    CHECK(pk2::serial_execution());
+    CHECK(pk2::load_pe(pk2::sample_loader(), pk2::sample_pe(256)));
+    CHECK(pk2::pe_version() == TARGET_PE_VERSION);
+
+    // rows, with the IR left on CONTROL by the version read
+    CHECK(pk2::program(TARGET_FLASH_BASE, image.data(), image.size(), 256) == 0);
+    CHECK(!memcmp(target::flash, image.data(), image.size() * 4));
+    CHECK(pk2::pe_crc32(TARGET_FLASH_BASE, image.size()) == pk2::crc32(image.data(), image.size()));
+
+    // past 0xFFFF words the CRC takes a second PE_READ; beyond the
+    // flash the model reads blank
+    flash.assign(target::flash, target::flash + TARGET_FLASH_SIZE / 4);
+    flash.resize(0x10010, ~0u);
+    CHECK(pk2::pe_crc32(TARGET_FLASH_BASE, flash.size()) == pk2::crc32(flash.data(), flash.size()));
+    CHECK(!(pk2::status() & ICD_TIMEOUT));
+    CHECK(pracc_waits_agree());
+
+    // slow, inside the deadline: the poll backs off and waits it out
+    target::t.pracc_us = 500;
+    CHECK(pk2::pe_version() == TARGET_PE_VERSION);
+    CHECK(!(pk2::status() & ICD_TIMEOUT));
+    CHECK(pracc_waits_agree());
+
+    // the response later than the script's 1 ms deadline
+    target::t.pracc_us = 3000;
+    idle(5);
+    pracc_timeouts();
+    bytes b = pk2::run({SCRIPT_JT2_SET_TIMEOUT, 1, 0, SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
+        SCRIPT_JT2_XFRFASTDAT_LIT, 0, 0, PE_EXEC_VERSION, 0, SCRIPT_JT2_GET_PE_RESP});
+    CHECK((b.size() == 4) && !pk2::get32(b.data()));
+    CHECK(pk2::status() & ICD_TIMEOUT);
+    CHECK(pracc_timeouts() == 1);
+    target::t.pracc_us = 2;
+    CHECK(late_response() == (PE_EXEC_VERSION << 16 | TARGET_PE_VERSION));
+    CHECK(pk2::pe_version() == TARGET_PE_VERSION);
+    CHECK(!(pk2::status() & ICD_TIMEOUT));
+
+    // a row the PE takes longer to program than PROGRAM_ROWS waits for
+    target::t.row_us = 2000000;
+    CHECK(pk2::program(TARGET_FLASH_BASE + 0x1000, image.data(), 32, 256) == ~0u);
+    CHECK(pk2::status() & ICD_TIMEOUT);
+    idle(1000);
+    CHECK(late_response() == PE_ROW_PROGRAM << 16);
+    target::t.row_us = 1500;
+    CHECK(!memcmp(target::flash + 0x1000 / 4, image.data(), 32 * 4));
+
+    // fast data while the PE is still busy with the last access
+    target::t.pracc_us = 3000;
+    idle(5);
+    b = pk2::run({SCRIPT_JT2_SENDCMD, ETAP_FASTDATA, SCRIPT_JT2_XFRFASTDAT_LIT,
+        0, 0, PE_EXEC_VERSION, 0, SCRIPT_JT2_GET_PE_RESP, SCRIPT_JT2_XFRFASTDAT_LIT,
+        0, 0, PE_EXEC_VERSION, 0});
+    CHECK((b.size() == 4) && (pk2::get32(b.data()) >> 16 == PE_EXEC_VERSION));
+    CHECK(pk2::status() & ICD_TIMEOUT);
+    target::t.pracc_us = 2;
+    idle(5);
+    pk2::script({SCRIPT_JT2_SETMODE, 6, 0x1f});     // the timeout left Test-Logic-Reset
+    CHECK(pk2::pe_version() == TARGET_PE_VERSION);
+
+    // the rings stay as they are under the upload stream; 16 KB and 4 KB
+    // leave no script ops
+    pk2::send({CMD_UPLOAD_STREAM, 1, CMD_PARTITION, 14, 12});
+    CHECK(pk2::reply(r) && (pk2::get32(r) == ~0u) && (pk2::get32(r + 4) == DOWNLOAD_SIZE));
+    pk2::send({CMD_UPLOAD_STREAM, 0, CMD_PARTITION, 14, 12});
+    CHECK(pk2::reply(r) && !pk2::get32(r) && (pk2::get32(r + 4) == 16384) && !pk2::get32(r + 12));
+    pk2::send({CMD_DOWNLOAD_SCRIPT, 0, 1, SCRIPT_BUSY_LED_ON});
+    CHECK(pk2::status() & 0x4000);                  // ScriptBufOvrFlow
+    return DONE();
+}
@@ -0,0 +1,187 @@
+// Per-phase timeline of a short pic32prog session from the firmware's
+// trace (CMD_TRACE, CMD_READ_TRACE): where the time goes between USB,
+// command handling, script ops and PrAcc waits. The CMD_PROGRAM_ROWS
+// job runs between reports without events of its own, so its time shows
+// under the command before it.
+//
+//   timeline [config] [-v]     config 1 HID (default), 2 bulk; -v lists
+//                              every event
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "pk2.h"
+#include "target.h"
+
+namespace {
+
+struct event {
+    unsigned time, id, arg;
+};
+
+const char *const op_names[] = {      // from SCRIPT_JT2_PE_CRC32
+    "JT2_PE_CRC32", "JT2_SET_TIMEOUT", "JT2_PE_PROG_RESP", "JT2_WAIT_PE_RESP",
+    "JT2_GET_PE_RESP", "JT2_XFERINST_BUF", "JT2_XFRFASTDAT_BUF",
+    "JT2_XFRFASTDAT_LIT", "JT2_XFERDATA32_LIT", "JT2_XFERDATA8_LIT",
+    "JT2_SENDCMD", "JT2_SETMODE", "UNIO_TX_RX", "UNIO_TX", "MEASURE_PULSE",
+    "ICDSLAVE_TX_BUF_BL", "ICDSLAVE_TX_LIT_BL", "ICDSLAVE_RX_BL",
+    "SPI_RDWR_BYTE_BUF", "SPI_RDWR_BYTE_LIT", "SPI_RD_BYTE_BUF",
+    "SPI_WR_BYTE_BUF", "SPI_WR_BYTE_LIT", "I2C_RD_BYTE_NACK",
+    "I2C_RD_BYTE_ACK", "I2C_WR_BYTE_BUF", "I2C_WR_BYTE_LIT", "I2C_STOP",
+    "I2C_START", "AUX_STATE_BUFFER", "SET_AUX", "WRITE_BITS_BUF_HLD",
+    "WRITE_BITS_LIT_HLD", "CONST_WRITE_DL", "WRITE_BUFBYTE_W",
+    "WRITE_BUFWORD_W", "RD2_BITS_BUFFER", "RD2_BYTE_BUFFER", "VISI24", "NOP24",
+    "COREINST24", "COREINST18", "POP_DOWNLOAD", "ICSP_STATES_BUFFER",
+    "LOOPBUFFER", "ICDSLAVE_TX_BUF", "ICDSLAVE_TX_LIT", "ICDSLAVE_RX",
+    "POKE_SFR", "PEEK_SFR", "EXIT_SCRIPT", "GOTO_INDEX", "IF_GT_GOTO",
+    "IF_EQ_GOTO", "DELAY_SHORT", "DELAY_LONG", "LOOP", "SET_ICSP_SPEED",
+    "READ_BITS", "READ_BITS_BUFFER", "WRITE_BITS_BUFFER", "WRITE_BITS_LITERAL",
+    "READ_BYTE", "READ_BYTE_BUFFER", "WRITE_BYTE_BUFFER", "WRITE_BYTE_LITERAL",
+    "SET_ICSP_PINS", "BUSY_LED_OFF", "BUSY_LED_ON", "MCLR_GND_OFF",
+    "MCLR_GND_ON", "VPP_PWM_OFF", "VPP_PWM_ON", "VPP_OFF", "VPP_ON",
+    "VDD_GND_OFF", "VDD_GND_ON", "VDD_OFF", "VDD_ON"
+};
+
+bool verbose;
+
+std::string describe(const event &e) {
+    char s[48];
+    switch (e.id) {
+        case TRACE_COMMAND: snprintf(s, sizeof s, "command %02X", e.arg); return s;
+        case TRACE_OP:
+            if (e.arg - SCRIPT_JT2_PE_CRC32 < sizeof(op_names) / sizeof(*op_names))
+                return op_names[e.arg - SCRIPT_JT2_PE_CRC32];
+            return "op ?";
+        case TRACE_PRACC:
+            if (e.arg == 0xffffff) return "PrAcc timed out";
+            snprintf(s, sizeof s, "PrAcc after %u us", e.arg);
+            return s;
+        case TRACE_USB:
+            snprintf(s, sizeof s, "USB %s %u", (e.arg & 0xff) < 6 ? "OUT" : "IN", e.arg >> 8);
+            return s;
+        default: return "?";
+    }
+}
+
+// The trace from now on; reads it, oldest first, up to the end of the
+// phase. The reads trace themselves, so events after end are dropped.
+unsigned begin(void) {
+    pk2::send({CMD_TRACE, 1});
+    sim::drain(100);
+    return sim::ticks();
+}
+
+std::vector<event> collect(unsigned start, unsigned *lost) {
+    unsigned end = sim::ticks(), i, n;
+    unsigned char r[64];
+    std::vector<event> events;
+    bool past = false;
+    *lost = 0;
+    while (!past) {
+        pk2::send({CMD_READ_TRACE});
+        if (!pk2::reply(r) || !r[0]) break;
+        *lost += r[1] | r[2] << 8;
+        for (i = 0, n = r[0]; i < n; i++) {
+            event e = {pk2::get32(r + 3 + 8 * i), r[7 + 8 * i], pk2::get32(r + 7 + 8 * i) >> 8};
+            if ((int)(e.time - start) < 0) continue;
+            if ((int)(e.time - end) > 0) past = true;
+            else events.push_back(e);
+        }
+    }
+    return events;
+}
+
+// Time from each event to the next goes to the last command or script
+// op, or after a USB event or the end of a report (command 00) to USB
+// and idle. Each PrAcc wait is then taken out of the spans it covers.
+void report(const char *phase, const std::vector<event> &events, unsigned lost) {
+    struct span {
+        unsigned start, end, kind;
+        std::string name;
+    };
+    std::vector<span> spans;
+    std::map<std::string, double> by_op;
+    double t[5] = {0}, total;
+    unsigned i, timeouts = 0, lo, hi;
+    const event *owner = 0;
+    if (events.empty()) return;
+    if (verbose) printf("%s\n", phase);
+    for (i = 0; i < events.size(); i++) {
+        const event &e = events[i];
+        if (verbose) printf("  %10.2f us  %s\n", (e.time - events[0].time) / 20.0, describe(e).c_str());
+        if (((e.id == TRACE_COMMAND) && e.arg) || (e.id == TRACE_OP)) owner = &e;
+        else if (e.id != TRACE_PRACC) owner = 0;
+        if (i + 1 < events.size())
+            spans.push_back({e.time, events[i + 1].time, owner ? owner->id : TRACE_USB,
+                owner ? describe(*owner) : ""});
+    }
+    for (const event &e : events) {
+        if (e.id != TRACE_PRACC) continue;
+        if (e.arg == 0xffffff) {
+            timeouts++;
+            continue;
+        }
+        for (span &s : spans) {
+            lo = std::max(s.start, e.time - e.arg * 20);
+            hi = std::min(s.end, e.time);
+            if (lo >= hi) continue;
+            t[TRACE_PRACC] += hi - lo;
+            s.end -= hi - lo;
+        }
+    }
+    for (const span &s : spans) {
+        t[s.kind] += s.end - s.start;
+        if (s.kind == TRACE_OP) by_op[s.name] += s.end - s.start;
+    }
+    total = events.back().time - events.front().time;
+    printf("%-18s %8.2f %6zu %5u", phase, total / SIM_TICKS_MS, events.size(), lost);
+    for (i = 1; i < 5; i++) printf(" %6.1f", total ? 100 * t[i] / total : 0);
+    if (timeouts) printf("  %u PrAcc timeouts", timeouts);
+    printf("\n");
+    for (auto &o : by_op)
+        if (o.second > total / 20)
+            printf("%-18s %8.2f  %s\n", "", o.second / SIM_TICKS_MS, o.first.c_str());
+}
+
+template <typename F>
+void phase(const char *name, F f) {
+    unsigned start = begin(), lost;
+    std::vector<event> events;
+    if (!f()) {
+        printf("%s failed\n", name);
+        exit(1);
+    }
+    events = collect(start, &lost);
+    report(name, events, lost);
+}
+
+}//anonymous
+
+int main(int argc, char **argv) {
+    int config = 1, i;
+    std::vector<unsigned> image(4 * 32);
+    for (i = 1; i < argc; i++)
+        if (!strcmp(argv[i], "-v")) verbose = true;
+        else config = atoi(argv[i]);
+    for (i = 0; i < (int)image.size(); i++) image[i] = i * 2654435761u;
+    sim::boot(config);
+    target::attach();
+    printf("configuration %d; the trace keeps the newest events of each phase\n", config);
+    printf("%-18s %8s %6s %5s %6s %6s %6s %6s\n", "phase", "ms", "events", "lost",
+        "cmd%", "op%", "PrAcc%", "idle%");
+    phase("ICSP entry", pk2::enter_icsp);
+    phase("erase", pk2::erase);
+    phase("serial execution", pk2::serial_execution);
+    phase("PE load", []() { return pk2::load_pe(pk2::sample_loader(), pk2::sample_pe(32)); });
+    phase("PE version", []() { return pk2::pe_version() == TARGET_PE_VERSION; });
+    phase("program 512 B", [&]() { return !pk2::program(TARGET_FLASH_BASE, image.data(), image.size(), 256); });
+    phase("verify 512 B", [&]() {
+        return pk2::pe_crc32(TARGET_FLASH_BASE, image.size()) == pk2::crc32(image.data(), image.size());
+    });
+    pk2::send({CMD_TRACE, 0});
+    sim::drain(100);
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef _XC_H    /* Guard against multiple inclusion */
+#define _XC_H
+
+// Stands in for the XC32 device header when the firmware is built for
+// the host simulation: the registers the sources use, backed by sim.cpp.
+
+#include "sim.h"
+
+extern sfr LATB, TRISB, PORTB, ANSELB, CNPUB, LATC, TRISC, ANSELC;
+extern sfr IEC0, IEC1, IFS0, IFS1, IPC0, IPC7, INTCON;
+extern sfr U1STAT, U1EP0, U1EP1, U1EP2, U1ADDR, U1EIR, U1IR, U1IE, U1CON, U1PWRC;
+extern sfr U1BDTP1, U1BDTP2, U1BDTP3;
+extern sfr NVMCON, NVMKEY, NVMADDR, NVMDATA, NVMSRCADDR;
+
+extern const sfr_alias LATBCLR, LATBSET, LATBINV, TRISBCLR, TRISBSET;
+extern const sfr_alias LATCSET, TRISCSET, ANSELBCLR, INTCONSET;
+extern const sfr_alias NVMCONCLR, NVMCONSET;
+
+typedef struct { sfr_field LATB2, LATB3, LATB9; } __LATBbits_t;
+extern const __LATBbits_t LATBbits;
+typedef struct { sfr_field TRISB2, TRISB3; } __TRISBbits_t;
+extern const __TRISBbits_t TRISBbits;
+typedef struct { sfr_field RB8; } __PORTBbits_t;
+extern const __PORTBbits_t PORTBbits;
+typedef struct { sfr_field CNPUB8; } __CNPUBbits_t;
+extern const __CNPUBbits_t CNPUBbits;
+typedef struct { sfr_field LATC0; } __LATCbits_t;
+extern const __LATCbits_t LATCbits;
+typedef struct { sfr_field TRISC0; } __TRISCbits_t;
+extern const __TRISCbits_t TRISCbits;
+typedef struct { sfr_field ANSC0; } __ANSELCbits_t;
+extern const __ANSELCbits_t ANSELCbits;
+typedef struct { sfr_field CTIE; } __IEC0bits_t;
+extern const __IEC0bits_t IEC0bits;
+typedef struct { sfr_field USBIE; } __IEC1bits_t;
+extern const __IEC1bits_t IEC1bits;
+typedef struct { sfr_field CTIF; } __IFS0bits_t;
+extern const __IFS0bits_t IFS0bits;
+typedef struct { sfr_field USBIF; } __IFS1bits_t;
+extern const __IFS1bits_t IFS1bits;
+typedef struct { sfr_field CTIP; } __IPC0bits_t;
+extern const __IPC0bits_t IPC0bits;
+typedef struct { sfr_field USBIP; } __IPC7bits_t;
+extern const __IPC7bits_t IPC7bits;
+typedef struct { sfr_field URSTIF, TRNIF, STALLIF; } __U1IRbits_t;
+extern const __U1IRbits_t U1IRbits;
+typedef struct { sfr_field USBEN, PPBRST, PKTDIS; } __U1CONbits_t;
+extern const __U1CONbits_t U1CONbits;
+typedef struct { sfr_field USBPWR, USBBUSY; } __U1PWRCbits_t;
+extern const __U1PWRCbits_t U1PWRCbits;
+
+#define _INTCON_MVEC_MASK   0x00001000
+#define _NVMCON_WR_MASK     0x00008000
+#define _NVMCON_WREN_MASK   0x00004000
+#define _NVMCON_WRERR_MASK  0x00002000
+#define _NVMCON_LVDERR_MASK 0x00001000
+
+#define _CORE_TIMER_VECTOR  0
+#define _USB_1_VECTOR       45
+
+unsigned _CP0_GET_COUNT(void);
+unsigned _CP0_GET_COMPARE(void);
+void _CP0_SET_COMPARE(unsigned compare);
+unsigned __builtin_disable_interrupts(void);
+unsigned __builtin_enable_interrupts(void);
+
+// XC32 attributes with no meaning on the host
+#define interrupt(ipl)      used
+#define vector(n)           used
+#define nomips16            used
+#define space(s)            used
+#define noload              used
+
+#endif /* _XC_H */
@@ -1,18 +1,15 @@
 #include "pickit.h"
 
-bool wait(unsigned i);
+bool wait(unsigned i), TaskAdd(void (*fn)(unsigned t), unsigned period);
 void USBDeviceInit(void), init(void), led(bool), button(unsigned);
 
 int main(void) {
     init();
     pickit_init();
+    TaskAdd(button, 1);
     led(true);
     wait(1000);
     led(false);
     USBDeviceInit();
     while (wait(0)) ProcessIO();
 }
-
-void poll(unsigned t) {
-    button(t);
-}
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <xc.h>                    // Device specific definitions
+#include "pickit.h"
 
 /*** DEVCFG0 ***/
 #pragma config DEBUG =      OFF
@@ -46,32 +47,111 @@ void init(void) {
     __builtin_enable_interrupts();
 }
 
-void poll(unsigned);
-
 namespace {
     
     volatile unsigned tick;
     
-    void loop(unsigned t) {
-        static unsigned tick;
-        if (tick == t) return;
-        poll(tick = t);
+    struct {                        // run-to-completion, every period ms
+        void (*fn)(unsigned t);
+        unsigned period, due;
+        unsigned runs, ticks, max;  // core timer ticks spent
+    } task[TASKS];
+    int tasks;
+    bool running;                   // no nesting when a task waits
+    
+    void schedule(void) {
+        unsigned now = tick, t;
+        if (running) return;
+        running = true;
+        for (int i = 0; i < tasks; i++) {
+            if ((int)(now - task[i].due) < 0) continue;
+            task[i].due = now + task[i].period;
+            t = _CP0_GET_COUNT();
+            task[i].fn(now);
+            t = _CP0_GET_COUNT() - t;
+            task[i].runs++;
+            task[i].ticks += t;
+            if (t > task[i].max) task[i].max = t;
+        }
+        running = false;
     }
     
 }//anonymous
 
+bool TaskAdd(void (*fn)(unsigned t), unsigned period) {
+    if (tasks == TASKS) return false;
+    task[tasks].fn = fn;
+    task[tasks].period = period;
+    task[tasks].due = tick;
+    tasks++;
+    return true;
+}
+
+// {runs} {ticks} {max ticks} of task i since the last call, false past
+// the last task.
+bool TaskStats(int i, unsigned *stats) {
+    if (i >= tasks) return false;
+    stats[0] = task[i].runs;
+    stats[1] = task[i].ticks;
+    stats[2] = task[i].max;
+    task[i].runs = task[i].ticks = task[i].max = 0;
+    return true;
+}
+
+// Runs due tasks while waiting i ms; wait(0) just gives them a turn.
 bool wait(unsigned i) {
     unsigned u = tick;
-    for (loop(u); i--; u = tick) while (u == tick) loop(u);
+    for (schedule(); i--; u = tick) while (u == tick) schedule();
     return true;
 }
 
 extern "C"
 void __attribute__((interrupt(ipl1soft), vector(_CORE_TIMER_VECTOR), nomips16))
 ctISR(void) {
-    _CP0_SET_COMPARE(_CP0_GET_COMPARE() + MS);
-    tick++;
+    unsigned compare = _CP0_GET_COMPARE();
+    do {                            // catch up after a flash write stall
+        compare += MS;
+        tick++;
+    } while ((int)(_CP0_GET_COUNT() - compare) >= 0);
+    _CP0_SET_COMPARE(compare);
     IFS0bits.CTIF = 0;
 }
 
 unsigned getTimeMilli(void) { return tick; }
+
+// Flash self-programming, addresses are virtual. Interrupts are held off
+// for the unlock sequence and the write; true when the write succeeded.
+namespace {
+
+    bool nvm(unsigned op) {
+        unsigned t, ie;
+        NVMCON = _NVMCON_WREN_MASK | op;
+        for (t = _CP0_GET_COUNT(); _CP0_GET_COUNT() - t < MS * 6 / 1000; );
+        ie = __builtin_disable_interrupts();    // LVD settled after 6us
+        NVMKEY = 0xAA996655;
+        NVMKEY = 0x556699AA;
+        NVMCONSET = _NVMCON_WR_MASK;
+        while (NVMCON & _NVMCON_WR_MASK);
+        if (ie & 1) __builtin_enable_interrupts();
+        NVMCONCLR = _NVMCON_WREN_MASK;
+        return !(NVMCON & (_NVMCON_WRERR_MASK | _NVMCON_LVDERR_MASK));
+    }
+
+}//anonymous
+
+bool NVMErasePage(const void *page) {
+    NVMADDR = (unsigned long)page & 0x1fffffff;
+    return nvm(4);
+}
+
+bool NVMWriteRow(const void *row, const void *data) {
+    NVMADDR = (unsigned long)row & 0x1fffffff;
+    NVMSRCADDR = (unsigned long)data & 0x1fffffff;
+    return nvm(3);
+}
+
+bool NVMWriteWord(const void *word, unsigned data) {
+    NVMADDR = (unsigned long)word & 0x1fffffff;
+    NVMDATA = data;
+    return nvm(1);
+}
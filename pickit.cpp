@@ -1,10 +1,14 @@
 #include <xc.h>
 #include "pickit.h"
 
-bool HIDReportRxd(void), HIDReportTxd(void);
-void HIDRxReport(void);
-void HIDTxReport(unsigned char *buf);
+unsigned char *HIDReportRxd(void), *HIDTxBuffer(void);
+void HIDRxReport(void), HIDTxReport(void);
+bool HIDConfigured(void);
 void wait(unsigned i);
+bool NVMErasePage(const void *page), NVMWriteRow(const void *row, const void *data);
+bool NVMWriteWord(const void *word, unsigned data);
+bool TaskStats(int i, unsigned *stats);
+void HIDStats(unsigned *stats);
 
 // RC0 - VPP
 // RB2 - PGC
@@ -20,22 +24,53 @@ void wait(unsigned i);
 #define MCLR_TGT_pin    LATCbits.LATC0
 #define Vpp_ON_pin      !TRISCbits.TRISC0
 
+#define CORE_TICKS_US   20      // core timer runs at SYSCLK / 2
+#define DELAY_SHORT_TICKS (CORE_TICKS_US * 427 / 10)    // 42.7us
+#define DELAY_LONG_TICKS  (CORE_TICKS_US * 5460)        // 5.46ms
+#define PRACC_TIMEOUT   1400    // ms, default PrAcc poll deadline
+#define PRACC_TIGHT     8       // polls back to back before backing off
+#define PRACC_GAP_MAX   (256 * CORE_TICKS_US)
+#define PRACC_BUCKETS   16      // log2 histogram buckets
+#define TRACE_EVENTS    256     // trace ring, power of two
+#define FLASH_PAGE      1024    // programmer flash erase page
+#define FLASH_ROW       128     // programmer flash program row
+#define LEARN_REPORTS   1024    // PK2GO store, 64 KB of OUT reports
+#define LEARN_MAGIC     0x4c324b50  // "PK2L"
+#define PE_SLOTS        2       // cached programming executives
+#define PE_SLOT_SIZE    0x2000  // bytes, header row then words
+#define PE_MAGIC        0x45503233  // "32PE"
+#define PE_ROW_PROGRAM  0x0000  // PE commands, {opcode:16 operand:16} {address}
+#define PE_READ         0x0001
+
 #define P32SetMode(bits, mode) jtag2w4ph(mode, 0, 1 << (bits - 1))
 #define P32SendCommand(command) jtag2w4ph(0x303, command << 4, 0x400)
 #define P32XferData8(data) (jtag2w4ph(0xc01, data << 3, 0x1000) >> 2)
 
-unsigned getTimeMilli(void);
+// EJTAG / MTAP instructions
+#define MTAP_SW_MTAP    0x04
+#define MTAP_SW_ETAP    0x05
+#define MTAP_COMMAND    0x07
+#define ETAP_ADDRESS    0x08
+#define ETAP_DATA       0x09
+#define ETAP_CONTROL    0x0A
+#define ETAP_EJTAGBOOT  0x0C
+#define ETAP_FASTDATA   0x0E
 
-unsigned char inbuffer[BUF_SIZE];            	 // input to USB device buffer
-unsigned char outbuffer[BUF_SIZE];            	 // output to USB device buffer
+unsigned getTimeMilli(void);
 
 namespace
 {
 
 unsigned char icsp_baud, icsp_pins;
 
-unsigned char uc_download_buffer[DOWNLOAD_SIZE]; // Download Data Buffer
-unsigned char uc_upload_buffer[UPLOAD_SIZE];     // Upload Data Buffer
+// ICSP clock engine. icsp_baud 0 clocks PGC as fast as the code allows;
+// otherwise a PGC period is icsp_baud us and every edge waits for its
+// own core timer deadline, so the loop overhead is absorbed rather than
+// added to the period.
+unsigned icsp_half;             // core timer ticks per PGC half period
+unsigned icsp_next;             // deadline of the next edge
+unsigned icsp_bits, icsp_ticks; // running totals, wrap safe as deltas
+unsigned rate_bits, rate_ticks; // totals at the last CMD_READ_ICSP_RATE
 
 union {		// Status bits
     unsigned short Status;
@@ -48,7 +83,7 @@ union {		// Status bits
 		unsigned VddError:1;
 		unsigned VppError:1;
         unsigned ButtonPressed:1;
-		unsigned :1;
+		unsigned LearnOvrFlow:1;  // learn store full, recording stopped
 		//StatusHigh
         unsigned Reset:1;       // bit 0
 		unsigned UARTMode:1;			
@@ -62,67 +97,255 @@ union {		// Status bits
     enum { RESETMASK=0x103, ERRMASK=0xFE00 };
 } Pk2Status;
 
-class RingBufferManager {
+// What a ring reports in Pk2Status when it runs dry or drops a byte.
+struct DownloadFlags {
+    static void empty(void) { Pk2Status.DownloadEmpty = 1; }
+    static void full(void) { Pk2Status.DownloadOvrFlow = 1; }
+};
+
+struct UploadFlags {
+    static void empty(void) {}
+    static void full(void) { Pk2Status.UpLoadFull = 1; }
+};
+
+// The size is a power of two set at run time from the arena: the
+// indexes run free, count is their difference and positions are
+// masked, so all size bytes are usable.
+template <class Flags>
+class RingBuffer {
 public:
-    RingBufferManager(unsigned char *b, int s): buffer(b), size(s)
-    { clearBuffer(); };
-    void clearBuffer(void) { read_index = write_index = 0; }
-    unsigned char readByte(void) {
-        unsigned char c;
-        if (read_index == write_index)
-        { Pk2Status.DownloadEmpty = 1; return 0; }
-        c = buffer[read_index++];
-        if (read_index == size) read_index = 0;
-        return c;
+    RingBuffer() : bytes_in(0), bytes_out(0) {}
+    void setBuffer(unsigned char *buf, unsigned size) {
+        buffer = buf;
+        mask = size - 1;
+        clearBuffer();
     }
-    int read2buffer(unsigned char *buf, int max) {
-        int count = 0;
-        while ((read_index != write_index) && (count < max))
-            buf[count++] = readByte();
-        return count;
+    void clearBuffer(void) { head = tail = 0; }
+    unsigned size(void) { return mask + 1; }
+    int count(void) { return head - tail; }
+    int room(void) { return mask + 1 - (head - tail); }
+    unsigned char readByte(void) {
+        if (head == tail) {
+            Flags::empty();
+            return 0;
+        }
+        bytes_out++;
+        return buffer[tail++ & mask];
     }
     unsigned readInt(void) {
-        unsigned i = 0;
-        for (int j = 0; j < 32; j += 8) i += (readByte() << j);
+        unsigned i;
+        if ((tail & 3) || (head - tail < 4)) {
+            i = readByte();
+            i |= readByte() << 8;
+            i |= readByte() << 16;
+            return i | (readByte() << 24);
+        }
+        i = *(unsigned *)(buffer + (tail & mask));  // aligned, no wrap
+        tail += 4;
+        bytes_out += 4;
         return i;
     }
-    void writeByte(unsigned char c) {
-        if (Pk2Status.UpLoadFull) return;
-        buffer[write_index++] = c;
-        if (write_index == size) write_index = 0;
-        if (read_index == write_index) Pk2Status.UpLoadFull = 1;
+    int read2buffer(unsigned char *buf, int max) {
+        unsigned n = head - tail, span;
+        if (n > (unsigned)max) n = max;
+        span = mask + 1 - (tail & mask);        // to the end of the buffer
+        if (span > n) span = n;
+        copy(buf, buffer + (tail & mask), span);
+        copy(buf + span, buffer, n - span);
+        tail += n;
+        bytes_out += n;
+        return n;
     }
-    unsigned char *writeBuffer(unsigned char *src) {
-        int count = *src++;
-        while (count--) writeByte(*src++);
-        return src;
+    void skip(int n) {
+        tail += n;
+        bytes_out += n;
+    }
+    int leading(unsigned char c, int max) {     // run of c at the head
+        int n = 0;
+        while ((n < max) && (tail + n != head) && (buffer[(tail + n) & mask] == c)) n++;
+        return n;
+    }
+    unsigned char lastByte(void) { return buffer[(head - 1) & mask]; }
+    void writeByte(unsigned char c) {
+        if (head - tail > mask) {
+            Flags::full();
+            return;
+        }
+        buffer[head++ & mask] = c;
+        bytes_in++;
     }
     void writeInt(unsigned i) {
-        for (int j = 0; j < 32; j += 8) writeByte(i >> j);
+        if ((head & 3) || (mask + 1 - (head - tail) < 4)) {
+            for (int j = 0; j < 32; j += 8) writeByte(i >> j);
+            return;
+        }
+        *(unsigned *)(buffer + (head & mask)) = i;
+        head += 4;
+        bytes_in += 4;
+    }
+    // {count} {bytes}, as CMD_DOWNLOAD_DATA; what does not fit is dropped
+    unsigned char *writeBuffer(unsigned char *src) {
+        unsigned count = *src++, n = mask + 1 - (head - tail), span;
+        if (n < count) Flags::full();
+        else n = count;
+        span = mask + 1 - (head & mask);
+        if (span > n) span = n;
+        copy(buffer + (head & mask), src, span);
+        copy(buffer, src + span, n - span);
+        head += n;
+        bytes_in += n;
+        return src + count;
     }
+    unsigned bytes_in, bytes_out;       // CMD_READ_COUNTERS
 private:
-    unsigned char *buffer;
-    int size, read_index, write_index;
+    static void copy(unsigned char *d, const unsigned char *s, unsigned n) {
+        while (n--) *d++ = *s++;
+    }
+    unsigned char *buffer;              // in the arena
+    unsigned mask, head, tail;          // head and tail free running
 };
-RingBufferManager ucDownloadBuffer(uc_download_buffer, DOWNLOAD_SIZE);
-RingBufferManager ucUploadBuffer(uc_upload_buffer, UPLOAD_SIZE);
+RingBuffer<DownloadFlags> ucDownloadBuffer;     // Download Data Buffer
+RingBuffer<UploadFlags> ucUploadBuffer;         // Upload Data Buffer
+
+// Download ring, upload ring, then stored script ops: CMD_PARTITION
+unsigned char arena[ARENA_SIZE] __attribute__((aligned(8)));
+
+bool upload_stream;     // CMD_UPLOAD_STREAM
+
+// CMD_DOWNLOAD_PACKED: records still to expand, in the held report, and
+// the run being written out. A pending 0xFF run is blank target memory.
+const unsigned char *packed, *packed_end;
+unsigned char fill_value;
+unsigned fill_count;
+unsigned char *resume;  // where ProcessIO continues in the held report
+
+struct {                // CMD_PROGRAM_ROWS
+    unsigned address;
+    unsigned rows;      // still to program or skip
+    unsigned words;     // per row
+    unsigned left;      // words of the current row still to send, 0 at a row start
+    unsigned skipped;   // blank rows not programmed
+    bool busy;          // row sent, the PE is programming it
+    unsigned since;     // ms, when busy started
+    unsigned consumed;  // download bytes taken, for the host's credit
+    unsigned credited;  // consumed as last reported to the host
+    bool owed;          // the final credit is still to be pushed
+} row_job;
+
+// PK2GO: OUT reports recorded in learn mode, replayed on a button press.
+// The header words are programmed one at a time: {magic} {reports} at
+// CMD_EXIT_LEARN_MODE, {go} = 0 by CMD_ENABLE_PK2GO_MODE.
+unsigned __attribute__((space(prog), aligned(FLASH_PAGE), noload))
+    learn_header[FLASH_PAGE / 4];
+unsigned char __attribute__((space(prog), aligned(FLASH_PAGE), noload))
+    learn_store[LEARN_REPORTS * BUF_SIZE];
+enum { LEARN_MAGIC_WORD, LEARN_COUNT_WORD, LEARN_GO_WORD };
+
+bool learning;                  // OUT reports are being recorded
+unsigned learn_count;           // reports recorded
+unsigned char learn_row[FLASH_ROW] __attribute__((aligned(4)));
+const unsigned char *replay;    // next recorded report, 0 when not replaying
+const unsigned char *replay_end;
+bool go_request;                // switch pressed in PK2GO mode
+unsigned char tx_scratch[BUF_SIZE]; // IN reports while replaying
+
+// IN reports; nobody reads them during a replay.
+unsigned char *TxBuffer(void) { return replay ? tx_scratch : HIDTxBuffer(); }
+void TxReport(void) { if (!replay) HIDTxReport(); }
+
+struct {                        // CMD_READ_TRACE, oldest overwritten
+    unsigned time;              // core timer
+    unsigned event;             // TRACE_ id | argument << 8
+} trace_ring[TRACE_EVENTS];
+unsigned trace_head, trace_count, trace_lost;
+bool tracing;                   // CMD_TRACE
+
+// Also called from the USB interrupt, hence the interrupts held off.
+void trace_put(unsigned id, unsigned arg) {
+    unsigned ie = __builtin_disable_interrupts();
+    trace_ring[trace_head].time = _CP0_GET_COUNT();
+    trace_ring[trace_head].event = id | arg << 8;
+    trace_head = (trace_head + 1) & (TRACE_EVENTS - 1);
+    if (trace_count < TRACE_EVENTS) trace_count++;
+    else trace_lost++;
+    if (ie & 1) __builtin_enable_interrupts();
+}
+
+inline void trace(unsigned id, unsigned arg) { if (tracing) trace_put(id, arg); }
+
+// PE cache: {magic} {version} {instruction words} {fast-data words}
+// {CRC-32 of the words} in the first row, word programmed once the
+// words behind it are in, so a slot with the magic is always whole.
+unsigned __attribute__((space(prog), aligned(FLASH_PAGE), noload))
+    pe_cache[PE_SLOTS][PE_SLOT_SIZE / 4];
+enum { PE_MAGIC_WORD, PE_VERSION_WORD, PE_INST_WORD, PE_FAST_WORD, PE_CRC_WORD };
+
+struct {                // CMD_PE_STORE
+    unsigned *slot;     // 0 when idle
+    unsigned version, inst, words;
+    unsigned at;        // words stored
+} pe_job;
+unsigned pe_row[FLASH_ROW / 4];
+
+struct {                // CMD_READ_COUNTERS, since last read
+    unsigned icsp_bits;     // icsp_bits at the last read
+    unsigned pracc_polls;
+    unsigned icd_timeouts;
+    unsigned tx_wait;       // core timer ticks waiting for an IN buffer
+    unsigned delay;         // core timer ticks in script delays
+} counters;
+
+void SetICDTimeOut(void) {
+    Pk2Status.ICDTimeOut = 1;
+    counters.icd_timeouts++;
+}
+
+unsigned pracc_fault;   // CMD_PRACC_FAULT, PrAcc samples still to fail
+unsigned pracc_timeout; // ms, SCRIPT_JT2_SET_TIMEOUT
+
+// CMD_READ_PRACC_STATS, since last read
+unsigned short pracc_polls[PRACC_BUCKETS];     // polls per wait, log2
+unsigned short pracc_latency[PRACC_BUCKETS];   // wait in us, log2
+unsigned short pracc_timeouts;
+
+// Wait out ticks of the core timer from now, letting the scheduler run.
+// A deadline, so time spent in tasks is absorbed rather than added.
+void delay_ticks(unsigned ticks) {
+    unsigned t = _CP0_GET_COUNT();
+    while (_CP0_GET_COUNT() - t < ticks) wait(0);
+}
+
+inline void icsp_edge(void) {
+    while ((int)(_CP0_GET_COUNT() - icsp_next) < 0);
+    icsp_next += icsp_half;
+}
 
 void ShiftByteOutICSP(unsigned byte) {
     LATBbits.LATB3 = byte & 1 ? 1 : 0;
     TRISBCLR = 0xc;     // PGD & PGC as output
     byte ^= byte << 1;
     byte |= 0x100;
-    while ((byte >>= 1) != 1) {
+    if (icsp_half) {
+        icsp_next = _CP0_GET_COUNT();
+        while ((byte >>= 1) != 1) {
+            icsp_edge();
+            LATBSET = 4;                    // CLK high
+            icsp_edge();
+            LATBINV = byte & 1 ? 12 : 4;    // CLK low
+        }
+        icsp_edge();
+    } else while ((byte >>= 1) != 1) {
         LATBSET = 4;                    // CLK high
         LATBINV = byte & 1 ? 12 : 4;    // CLK low
     }
     LATBSET = 4;                    // CLK high
     asm("nop");
+    if (icsp_half) icsp_edge();
     LATBCLR = 12;                   // CLK low
     TRISBSET = 8;     // PGD as input (KEEP PGC as output)
 }
 
-unsigned jtag2w4ph(unsigned TMS, unsigned TDI, unsigned TDO) {
+unsigned jtag2w4ph_fast(unsigned TMS, unsigned TDI, unsigned TDO) {
     unsigned mark = TDO;
     TMS ^= TDI;
     LATBCLR = 0xc;
@@ -147,6 +370,127 @@ unsigned jtag2w4ph(unsigned TMS, unsigned TDI, unsigned TDO) {
     return TDI;
 }
 
+// Clock n bits without sampling PGD. The target still owns PGD during
+// the TDO phase, so it is released there, but PGC is left as an output
+// and PORTB is never read.
+void jtag2w4ph_out(unsigned TMS, unsigned TDI, int n) {
+    TMS ^= TDI;
+    while (n--) {
+        TRISBCLR = 8;                   // PGD as output
+        LATBINV = TDI & 1 ? 12 : 4;     // CLK high
+        TDI >>= 1;
+        LATBCLR = 4;                    // CLK low
+        LATBINV = TMS & 1 ? 12 : 4;     // CLK high
+        TMS >>= 1;
+        LATBCLR = 4;                   // CLK low
+        TRISBSET = 8;                   // PGD as input
+        LATBSET = 4;                    // CLK high
+        LATBCLR = 4;                    // CLK low
+        LATBSET = 4;                    // CLK high
+        LATBCLR = 12;                    // CLK low
+    }
+}
+
+unsigned jtag2w4ph_slow(unsigned TMS, unsigned TDI, unsigned TDO) {
+    unsigned mark = TDO;
+    TMS ^= TDI;
+    LATBCLR = 0xc;
+    icsp_next = _CP0_GET_COUNT();
+    while (TDO) {
+        TRISBCLR = 0xc;                 // PGD & PGC as output
+        icsp_edge();
+        LATBINV = TDI & 1 ? 12 : 4;     // CLK high
+        TDI >>= 1;
+        icsp_edge();
+        LATBCLR = 4;                    // CLK low
+        icsp_edge();
+        LATBINV = TMS & 1 ? 12 : 4;     // CLK high
+        TMS >>= 1;
+        icsp_edge();
+        LATBCLR = 4;                   // CLK low
+        TRISBSET = 8;                   // PGD as input
+        icsp_edge();
+        LATBSET = 4;                    // CLK high
+        TDO >>= 1;        
+        icsp_edge();
+        LATBCLR = 4;                    // CLK low
+        icsp_edge();
+        LATBSET = 4;                    // CLK high
+        icsp_edge();
+        if (PORTB & 8) TDI |= mark;      // read PORT
+        LATBCLR = 12;                    // CLK low
+    }
+    TRISBSET = 8;                 // PGD as input (KEEP PGC as output)
+    return TDI;
+}
+
+unsigned jtag2w4ph(unsigned TMS, unsigned TDI, unsigned TDO) {
+    unsigned t = _CP0_GET_COUNT();
+    icsp_bits += 32 - __builtin_clz(TDO);
+    TDI = icsp_half ? jtag2w4ph_slow(TMS, TDI, TDO) : jtag2w4ph_fast(TMS, TDI, TDO);
+    icsp_ticks += _CP0_GET_COUNT() - t;
+    return TDI;
+}
+
+// Scans known at compile time, unrolled into straight-line pin writes.
+// Each bit is the jtag2w4ph_out bit with the PGD level already decided;
+// TDO is not sampled.
+template <unsigned TMS, unsigned TDI, int N>
+struct jtag_seq {
+    static inline __attribute__((always_inline)) void out(void) {
+        TRISBCLR = 0xc;                             // PGD & PGC as output
+        LATBINV = TDI & 1 ? 12 : 4;                 // CLK high
+        LATBCLR = 4;                                // CLK low
+        LATBINV = (TMS ^ TDI) & 1 ? 12 : 4;         // CLK high
+        LATBCLR = 4;                                // CLK low
+        TRISBSET = 8;                               // PGD as input
+        LATBSET = 4;                                // CLK high
+        LATBCLR = 4;                                // CLK low
+        LATBSET = 4;                                // CLK high
+        LATBCLR = 12;                               // CLK low
+        jtag_seq<(TMS >> 1), (TDI >> 1), N - 1>::out();
+    }
+};
+
+template <unsigned TMS, unsigned TDI>
+struct jtag_seq<TMS, TDI, 0> {
+    static inline __attribute__((always_inline)) void out(void) {}
+};
+
+// Same scan as jtag2w4ph(TMS, TDI, 1 << (N - 1)), result discarded.
+template <unsigned TMS, unsigned TDI, int N>
+void jtag_fixed(void) {
+    unsigned t;
+    if (icsp_half) {
+        jtag2w4ph(TMS, TDI, 1 << (N - 1));
+        return;
+    }
+    t = _CP0_GET_COUNT();
+    LATBCLR = 0xc;
+    jtag_seq<TMS, TDI, N>::out();
+    icsp_bits += N;
+    icsp_ticks += _CP0_GET_COUNT() - t;
+}
+
+template <unsigned command>
+void P32SendCmd(void) { jtag_fixed<0x303, command << 4, 11>(); }
+
+template <unsigned bits, unsigned mode>
+void P32SetModeFixed(void) { jtag_fixed<mode, 0, bits>(); }
+
+template <unsigned data>
+void P32WriteData32(void) {
+    jtag_fixed<1, (data & 0xffff) << 3, 19>();
+    jtag_fixed<0x18000, (data >> 16), 18>();
+}
+
+// PrAcc as sampled from the target, unless a fault is being injected.
+inline bool PrAcc(unsigned ready) {
+    if (!pracc_fault) return ready;
+    if (pracc_fault != ~0u) pracc_fault--;
+    return false;
+}
+
 unsigned P32XferData32(unsigned data){
     unsigned lower = data & 0xffff;
     unsigned upper = data >> 16;
@@ -159,315 +503,1195 @@ unsigned P32XferFastData32(unsigned data) {
     unsigned lower = data & 0xffff;
     unsigned upper = data >> 16;
     lower = jtag2w4ph(1, lower << 4, 0x80000);
-    if (!(lower & 4)) {
-        P32SetMode(5, 0x1f);
-        Pk2Status.ICDTimeOut = 1;
+    if (!PrAcc(lower & 4)) {
+        P32SetModeFixed<5, 0x1f>();
+        SetICDTimeOut();
         return 0;
     }
     upper = jtag2w4ph(0x18000, upper, 0x20000);
     return (lower >> 3) | (upper << 17);
 }
 
-unsigned P32XferInstruction(unsigned ins) {
-    unsigned response;
-    unsigned t = getTimeMilli() + 1400;
-    P32SendCommand(0x0A);           // ETAP_CONTROL
-    while (!(P32XferData32(0x4d000) & 0x40000)) {
+// n words from the download buffer, or from words, each the same 38-bit
+// scan as P32XferFastData32: Select-DR, Capture-DR, Shift-DR (TDO is
+// PrAcc), PrAcc in, 32 data bits ending in Exit1-DR, Update-DR,
+// Run-Test/Idle.
+void P32XferFastDataBlock(unsigned n, const unsigned *words = 0) {
+    unsigned data, t;
+    if (icsp_half) {                    // paced clock, a word at a time
+        while (n--) P32XferFastData32(words ? *words++ : ucDownloadBuffer.readInt());
+        return;
+    }
+    t = _CP0_GET_COUNT();
+    icsp_bits += n * 38;
+    while (n--) {
+        data = words ? *words++ : ucDownloadBuffer.readInt();
+        if (!PrAcc(jtag2w4ph_fast(1, 0, 4) & 4)) {
+            P32SetModeFixed<5, 0x1f>();
+            SetICDTimeOut();
+            break;
+        }
+        jtag2w4ph_out(0, data << 1, 17);
+        jtag2w4ph_out(0x18000, data >> 16, 18);
+    }
+    icsp_ticks += _CP0_GET_COUNT() - t;
+}
+
+// Saturating count into the log2 bucket of n: 0, 1, 2-3, 4-7, ...
+void histogram(unsigned short *h, unsigned n) {
+    n = n ? 32 - __builtin_clz(n) : 0;
+    if (n >= PRACC_BUCKETS) n = PRACC_BUCKETS - 1;
+    if (h[n] != 0xffff) h[n]++;
+}
+
+// Poll ETAP_CONTROL until the target sets PrAcc. The first polls go
+// back to back, which catches a quick PE; after that the gap between
+// polls doubles up to PRACC_GAP_MAX. The deadline is elapsed time, so
+// neither a wrap of the ms counter nor a missed tick can skip it.
+bool P32WaitPrAcc(void) {
+    unsigned start = _CP0_GET_COUNT(), ms = getTimeMilli();
+    unsigned polls = 1, gap = 0;
+    P32SendCmd<ETAP_CONTROL>();
+    while (!PrAcc(P32XferData32(0x4d000) & 0x40000)) {
         wait(0);
-        if (getTimeMilli() == t) {
-            Pk2Status.ICDTimeOut = 1;
-            return 0;          
+        if (getTimeMilli() - ms >= pracc_timeout) {
+            if (pracc_timeouts != 0xffff) pracc_timeouts++;
+            SetICDTimeOut();
+            trace(TRACE_PRACC, 0xffffff);
+            return false;
+        }
+        if (++polls > PRACC_TIGHT) {
+            gap = gap ? gap << 1 : CORE_TICKS_US;
+            if (gap > PRACC_GAP_MAX) gap = PRACC_GAP_MAX;
+            delay_ticks(gap);
         }
     }
-    P32SendCommand(0x09);           // ETAP_DATA
+    start = (_CP0_GET_COUNT() - start) / CORE_TICKS_US;
+    counters.pracc_polls += polls;
+    histogram(pracc_polls, polls);
+    histogram(pracc_latency, start);
+    trace(TRACE_PRACC, start);
+    return true;
+}
+
+unsigned P32XferInstruction(unsigned ins) {
+    unsigned response;
+    if (!P32WaitPrAcc()) return 0;
+    P32SendCmd<ETAP_DATA>();
     response = P32XferData32(ins);
-    P32SendCommand(0x0A);           // ETAP_CONTROL
-    P32XferData32(0xc000);
+    P32SendCmd<ETAP_CONTROL>();
+    P32WriteData32<0xc000>();
     return response;
 }
 
-unsigned P32GetPEResponse(void) {
+// One PrAcc sample, for callers that do other work between polls.
+bool P32PrAccReady(void) {
+    P32SendCmd<ETAP_CONTROL>();
+    return PrAcc(P32XferData32(0x4d000) & 0x40000);
+}
+
+// The PE response once PrAcc is set.
+unsigned P32ReadPEResponse(void) {
     unsigned response;
-    unsigned t = getTimeMilli() + 1400;
-    P32SendCommand(0x0A);           // ETAP_CONTROL
-    while (!(P32XferData32(0x4d000) & 0x40000)) {
-        wait(0);
-        if (getTimeMilli() == t) {
-            Pk2Status.ICDTimeOut = 1;
-            return 0;          
-        }
-    }
-    P32SendCommand(0x09);           // ETAP_DATA
+    P32SendCmd<ETAP_DATA>();
     response = P32XferData32(0);
-    P32SendCommand(0x0A);           // ETAP_CONTROL
-    P32XferData32(0xc000);
+    P32SendCmd<ETAP_CONTROL>();
+    P32WriteData32<0xc000>();
     return response;
 }
 
+unsigned P32GetPEResponse(void) {
+    return P32WaitPrAcc() ? P32ReadPEResponse() : 0;
+}
+
+// CRC-32 (IEEE 802.3, reflected), table built at compile time into flash
+struct crc32_table {
+    unsigned t[256];
+    constexpr crc32_table() : t() {
+        for (unsigned i = 0; i < 256; i++) {
+            unsigned c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+            t[i] = c;
+        }
+    }
+};
+constexpr crc32_table crc32;
+
+// Fold one target word, low byte first as it sits in memory.
+inline unsigned crc32_word(unsigned crc, unsigned w) {
+    crc = (crc >> 8) ^ crc32.t[(crc ^ w) & 0xff];
+    crc = (crc >> 8) ^ crc32.t[(crc ^ (w >> 8)) & 0xff];
+    crc = (crc >> 8) ^ crc32.t[(crc ^ (w >> 16)) & 0xff];
+    return (crc >> 8) ^ crc32.t[(crc ^ (w >> 24)) & 0xff];
+}
+
+// CRC-32 of words target words from address, read through the PE. Only
+// the digest leaves the programmer, so verify runs at the ICSP rate.
+unsigned P32PECrc32(unsigned address, unsigned words) {
+    unsigned crc = ~0u, n;
+    while (words) {
+        n = words < 0xffff ? words : 0xffff;
+        P32SendCmd<ETAP_FASTDATA>();        // the last response left CONTROL
+        P32XferFastData32((PE_READ << 16) | n);
+        P32XferFastData32(address);
+        if (P32GetPEResponse() != PE_READ << 16) {
+            SetICDTimeOut();
+            break;
+        }
+        words -= n;
+        address += n << 2;
+        while (n--) crc = crc32_word(crc, P32GetPEResponse());
+        if (Pk2Status.ICDTimeOut) break;
+    }
+    return ~crc;
+}
+
+// The packed data left when the download buffer is full: held while a
+// row or PE job drains the buffer, else dropped as CMD_DOWNLOAD_DATA
+// drops what does not fit.
+bool PackedFull(void) {
+    if (row_job.rows || pe_job.slot) return false;
+    Pk2Status.DownloadOvrFlow = 1;
+    packed = packed_end;
+    fill_count = 0;
+    return true;
+}
+
+// Expand packed records into the download buffer as far as it has room.
+// Returns true once every record and run is in, or dropped.
+bool Unpack(void) {
+    unsigned n;
+    for (;;) {
+        for (; fill_count; fill_count--) {
+            if (ucDownloadBuffer.room() <= 0) return PackedFull();
+            ucDownloadBuffer.writeByte(fill_value);
+        }
+        if (packed >= packed_end) return true;
+        n = *packed;
+        if (packed + (n < 0x80 ? n + 2 : n < 0xc0 ? 2 : 3) > packed_end) {
+            Pk2Status.DownloadOvrFlow = 1;      // truncated record
+            packed = packed_end;
+            return true;
+        }
+        if (n < 0x80) {                 // literal
+            if (ucDownloadBuffer.room() <= (int)n) return PackedFull();
+            for (packed++, n++; n--; ) ucDownloadBuffer.writeByte(*packed++);
+        } else if (n < 0xc0) {          // run
+            fill_value = packed[1];
+            fill_count = (n & 0x3f) + 3;
+            packed += 2;
+        } else {                        // blank
+            fill_value = 0xff;
+            fill_count = ((n & 0x3f) << 16 | packed[2] << 8 | packed[1]) + 1;
+            packed += 3;
+        }
+    }
+}
+
+// Records past the end of the report are cut off, as a truncated record.
+unsigned char *DownloadPacked(unsigned char *p, unsigned char *end) {
+    packed = p + 1;
+    packed_end = packed + *p;
+    if (packed_end > end) {
+        Pk2Status.DownloadOvrFlow = 1;
+        packed_end = end;
+    }
+    return (unsigned char *)packed_end;
+}
+
+// True, and the row consumed, when the next bytes of the download stream
+// are all 0xFF: in the buffer, then in a pending blank run.
+bool SkipBlank(unsigned bytes) {
+    unsigned n = ucDownloadBuffer.leading(0xff, bytes);
+    if (n < bytes) {
+        if ((n < (unsigned)ucDownloadBuffer.count()) || (fill_value != 0xff) ||
+            (fill_count < bytes - n)) return false;
+        fill_count -= bytes - n;
+    }
+    ucDownloadBuffer.skip(n);
+    return true;
+}
+
+// Program rows through the PE from the download stream. Runs a step at
+// a time from ProcessIO: it returns whenever it needs data the host has
+// not sent yet, or while the PE programs a row, and picks up from there
+// on the next pass. So the next row arrives over USB while the target
+// programs the last. The final {status} {blank rows skipped} goes to
+// the upload buffer; status is 0, the failing PE response, or ~0 for a
+// PrAcc timeout.
+void ProgramRows(void) {
+    unsigned n, response, bytes = row_job.words << 2;
+    while (row_job.rows) {
+        Unpack();
+        if (row_job.busy) {
+            if (P32PrAccReady()) response = P32ReadPEResponse();
+            else if (getTimeMilli() - row_job.since < pracc_timeout) return;
+            else {
+                SetICDTimeOut();
+                response = ~0u;
+            }
+            row_job.busy = false;
+            if (response != PE_ROW_PROGRAM << 16) break;
+        } else if (!row_job.left) {     // a whole row, or a full buffer
+            n = ucDownloadBuffer.count() + fill_count;
+            if (n < bytes && n < ucDownloadBuffer.size()) return;
+            if (SkipBlank(bytes)) {
+                row_job.consumed += bytes;
+                row_job.skipped++;
+            } else {
+                P32SendCmd<ETAP_FASTDATA>();    // reading the response left CONTROL
+                P32XferFastData32((PE_ROW_PROGRAM << 16) | row_job.words);
+                P32XferFastData32(row_job.address);
+                row_job.left = row_job.words;
+                continue;
+            }
+        } else {
+            n = ucDownloadBuffer.count() >> 2;
+            if (n > row_job.left) n = row_job.left;
+            if (!n) return;
+            P32XferFastDataBlock(n);
+            row_job.consumed += n << 2;
+            if (Pk2Status.ICDTimeOut) {
+                response = ~0u;
+                break;
+            }
+            if ((row_job.left -= n)) continue;
+            row_job.busy = true;
+            row_job.since = getTimeMilli();
+            continue;
+        }
+        row_job.address += bytes;
+        if (!--row_job.rows) response = 0;
+    }
+    row_job.rows = 0;
+    ucUploadBuffer.writeInt(response);
+    ucUploadBuffer.writeInt(row_job.skipped);
+}
+
+// Push a credit report once the job has taken another report's worth of
+// download data, and once more when it ends.
+void SendCredit(void) {
+    unsigned char *buf;
+    unsigned n = row_job.consumed;
+    if (!row_job.owed) return;
+    if (row_job.rows && (n - row_job.credited < BUF_SIZE - 2)) return;
+    if (!(buf = TxBuffer())) return;
+    buf[0] = CMD_PROGRAM_ROWS;
+    for (int i = 0; i < 4; i++) buf[1 + i] = n >> (i << 3);
+    buf[5] = row_job.rows;
+    buf[6] = row_job.rows >> 8;
+    TxReport();
+    row_job.credited = n;
+    row_job.owed = row_job.rows != 0;
+}
+
+unsigned char *StartRows(unsigned char *p) {
+    row_job.address = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+    row_job.rows = p[4] | (p[5] << 8);
+    row_job.words = p[6] | (p[7] << 8);
+    row_job.left = row_job.skipped = 0;
+    row_job.consumed = row_job.credited = 0;
+    row_job.busy = false;
+    row_job.owed = true;
+    Pk2Status.ICDTimeOut = 0;
+    if (!row_job.words || !row_job.rows) {  // nothing to program, end now
+        ucUploadBuffer.writeInt(row_job.words ? 0 : ~0u);
+        ucUploadBuffer.writeInt(0);
+        row_job.rows = 0;
+    }
+    return p + 8;
+}
+
+// Append an OUT report to the PK2GO store a flash row at a time, erasing
+// each page as it is reached.
+void Learn(const unsigned char *report) {
+    unsigned at = learn_count * BUF_SIZE;
+    if (learn_count >= LEARN_REPORTS) {
+        learning = false;
+        Pk2Status.LearnOvrFlow = 1;
+        return;
+    }
+    if (!(at & (FLASH_PAGE - 1))) NVMErasePage(learn_store + at);
+    for (int i = 0; i < BUF_SIZE; i++) learn_row[(at & (FLASH_ROW - 1)) + i] = report[i];
+    learn_count++;
+    if (!((at + BUF_SIZE) & (FLASH_ROW - 1)))
+        NVMWriteRow(learn_store + (at & ~(FLASH_ROW - 1)), learn_row);
+}
+
+bool Pk2GoKey(const unsigned char *p) {
+    return (p[0] == 0x50) && (p[1] == 0x4B) && (p[2] == 0x32);
+}
+
+unsigned char *EnterLearn(unsigned char *p) {
+    if (Pk2GoKey(p)) {
+        NVMErasePage(learn_header);
+        learn_count = 0;
+        learning = true;
+    }
+    return p + 4;               // {EEsize} is not needed
+}
+
+void ExitLearn(void) {
+    if (!learning) return;
+    learning = false;
+    if (learn_count & 1) {      // half a row still in RAM
+        for (int i = BUF_SIZE; i < FLASH_ROW; i++) learn_row[i] = 0xff;
+        NVMWriteRow(learn_store + (learn_count - 1) * BUF_SIZE, learn_row);
+    }
+    NVMWriteWord(learn_header + LEARN_COUNT_WORD, learn_count);
+    NVMWriteWord(learn_header + LEARN_MAGIC_WORD, LEARN_MAGIC);
+}
+
+unsigned char *EnablePk2Go(unsigned char *p) {
+    if (Pk2GoKey(p) && (learn_header[LEARN_MAGIC_WORD] == LEARN_MAGIC))
+        NVMWriteWord(learn_header + LEARN_GO_WORD, 0);
+    return p + 4;
+}
+
+// Only as a line station: with a host attached the switch is its own.
+void StartReplay(void) {
+    go_request = false;
+    if (HIDConfigured()) return;
+    if ((learn_header[LEARN_MAGIC_WORD] != LEARN_MAGIC) ||
+        learn_header[LEARN_GO_WORD] || !learn_header[LEARN_COUNT_WORD]) return;
+    replay = learn_store;
+    replay_end = learn_store + learn_header[LEARN_COUNT_WORD] * BUF_SIZE;
+    Pk2Status.Status &= ~Pk2Status.ERRMASK;
+    BUSY_LED = 1;
+}
+
+// Done with the report at the head: free its USB slot, or step the
+// replay. A replay ends with BUSY lit if anything failed.
+void ReleaseReport(void) {
+    if (!replay) {
+        HIDRxReport();
+        return;
+    }
+    if ((replay += BUF_SIZE) < replay_end) return;
+    replay = 0;
+    BUSY_LED = (Pk2Status.Status & Pk2Status.ERRMASK) ? 1 : 0;
+}
+
+// A replay has no credits to pace it: the command at p waits while a
+// row or PE job is running and needs the download buffer, or the PE, to
+// itself, as the host waited when the session was recorded.
+bool ReplayHold(const unsigned char *p) {
+    if (!row_job.rows && !pe_job.slot) return false;
+    switch (*p) {
+        case CMD_DOWNLOAD_DATA:
+            return ucDownloadBuffer.room() < p[1];
+        case CMD_EXECUTE_SCRIPT:
+        case CMD_RUN_SCRIPT:
+        case CMD_CLEAR_DOWNLOAD_BUFFER:
+        case CMD_PROGRAM_ROWS:
+        case CMD_PE_STORE:
+        case CMD_PE_INJECT:
+        case CMD_PARTITION:
+            return true;
+        default: return false;
+    }
+}
+
+unsigned char *StorePE(unsigned char *p) {
+    unsigned i, words;
+    if (p[0] >= PE_SLOTS) Pk2Status.EmptyScript = 1;
+    else {
+        pe_job.version = p[1] | (p[2] << 8);
+        pe_job.inst = p[3] | (p[4] << 8);
+        words = pe_job.inst + (p[5] | (p[6] << 8));
+        if (words <= (PE_SLOT_SIZE - FLASH_ROW) / 4) {
+            pe_job.slot = pe_cache[p[0]];
+            pe_job.words = words;
+            pe_job.at = 0;
+            for (i = 0; i < PE_SLOT_SIZE; i += FLASH_PAGE)
+                NVMErasePage((unsigned char *)pe_job.slot + i);
+        } else Pk2Status.ScriptBufOvrFlow = 1;
+    }
+    return p + 7;
+}
+
+// Move download words into the slot a flash row at a time; the header
+// goes in after the last row.
+void StorePEWords(void) {
+    unsigned *data = pe_job.slot + FLASH_ROW / 4, crc = ~0u, i;
+    while ((pe_job.at < pe_job.words) && (ucDownloadBuffer.count() >= 4)) {
+        pe_row[pe_job.at % (FLASH_ROW / 4)] = ucDownloadBuffer.readInt();
+        if ((++pe_job.at % (FLASH_ROW / 4)) && (pe_job.at < pe_job.words)) continue;
+        for (i = pe_job.at % (FLASH_ROW / 4); i && (i < FLASH_ROW / 4); i++) pe_row[i] = ~0u;
+        NVMWriteRow(data + ((pe_job.at - 1) & ~(FLASH_ROW / 4 - 1)), pe_row);
+    }
+    if (pe_job.at < pe_job.words) return;
+    for (i = 0; i < pe_job.words; i++) crc = crc32_word(crc, data[i]);
+    NVMWriteWord(pe_job.slot + PE_VERSION_WORD, pe_job.version);
+    NVMWriteWord(pe_job.slot + PE_INST_WORD, pe_job.inst);
+    NVMWriteWord(pe_job.slot + PE_FAST_WORD, pe_job.words - pe_job.inst);
+    NVMWriteWord(pe_job.slot + PE_CRC_WORD, ~crc);
+    NVMWriteWord(pe_job.slot + PE_MAGIC_WORD, PE_MAGIC);
+    pe_job.slot = 0;
+}
+
+// Load a cached PE into the target as the host would: the loader as
+// serial-execution instructions, then the rest as fast data.
+unsigned char *InjectPE(unsigned char *p) {
+    unsigned *slot, *data, i;
+    if ((*p >= PE_SLOTS) || (pe_cache[*p][PE_MAGIC_WORD] != PE_MAGIC)) {
+        Pk2Status.EmptyScript = 1;
+        return ++p;
+    }
+    slot = pe_cache[*p];
+    data = slot + FLASH_ROW / 4;
+    for (i = 0; (i < slot[PE_INST_WORD]) && !Pk2Status.ICDTimeOut; i++)
+        P32XferInstruction(data[i]);
+    if (!Pk2Status.ICDTimeOut) {
+        P32SendCmd<ETAP_FASTDATA>();
+        P32XferFastDataBlock(slot[PE_FAST_WORD], data + slot[PE_INST_WORD]);
+    }
+    return ++p;
+}
+
+void ClearDownload(void) {
+    ucDownloadBuffer.clearBuffer();
+    packed = packed_end = 0;
+    fill_count = 0;
+}
+
 ///////////////////////////////////////////////////////////////////
 ///   SCRIPT ENGINE
-///   abort - VPP_PWM_OFF, VDD_OFF, VDD_GND_ON, VPP_PWM_ON
-    
-unsigned char *jt2_sendcmd(unsigned char *p) {
-    P32SendCommand(*++p);
-    return ++p;
+///   Scripts are checked and translated once into ops: the handler,
+///   its operands packed little-endian into arg and, for jumps, the
+///   distance counted in ops, and the opcode for the trace. Handlers
+///   return the next op, 0 aborts.
+///   abort - marks script instructions this programmer does not have
+
+struct op;
+typedef const op* (*sf)(const op*);
+struct op {
+    sf fn;
+    unsigned arg;
+    unsigned char code;         // script opcode
+};
+
+struct context {                // state of one scriptEngine() run
+    const op *end;
+    struct {
+        const op *at;           // the LOOP / LOOPBUFFER op
+        unsigned count;         // jumps back still to do
+    } loop[LOOP_DEPTH];
+    int depth;
+} *ctx;
+
+const op *jt2_sendcmd(const op *o) {
+    P32SendCommand(o->arg);
+    return ++o;
 }
 
-unsigned char *jt2_xferdata32_lit(unsigned char *p) {
-    unsigned i = 0;
-    for (int j = 0; j < 32; j += 8) i += (*++p) << j;
-    ucUploadBuffer.writeInt(P32XferData32(i));
-    return ++p;
+template <unsigned command>
+const op *jt2_sendcmd_fixed(const op *o) {
+    P32SendCmd<command>();
+    return ++o;
 }
 
-unsigned char *jt2_xferdata8_lit(unsigned char *p) {
-    ucUploadBuffer.writeByte(P32XferData8(*++p));
-    return ++p;
+// JT2_SENDCMD operands with an unrolled handler
+const struct {
+    unsigned char command;
+    sf fn;
+} fixed_command[] = {
+    { MTAP_SW_MTAP, jt2_sendcmd_fixed<MTAP_SW_MTAP> },
+    { MTAP_SW_ETAP, jt2_sendcmd_fixed<MTAP_SW_ETAP> },
+    { MTAP_COMMAND, jt2_sendcmd_fixed<MTAP_COMMAND> },
+    { ETAP_ADDRESS, jt2_sendcmd_fixed<ETAP_ADDRESS> },
+    { ETAP_DATA, jt2_sendcmd_fixed<ETAP_DATA> },
+    { ETAP_CONTROL, jt2_sendcmd_fixed<ETAP_CONTROL> },
+    { ETAP_EJTAGBOOT, jt2_sendcmd_fixed<ETAP_EJTAGBOOT> },
+    { ETAP_FASTDATA, jt2_sendcmd_fixed<ETAP_FASTDATA> }
+};
+
+const op *jt2_xferdata32_lit(const op *o) {
+    ucUploadBuffer.writeInt(P32XferData32(o->arg));
+    return ++o;
 }
 
-unsigned char *jt2_setmode(unsigned char *p) {
-    int bits = *++p;
-    P32SetMode(bits, *++p);
-    return ++p;
+const op *jt2_xferdata8_lit(const op *o) {
+    ucUploadBuffer.writeByte(P32XferData8(o->arg));
+    return ++o;
+}
+
+const op *jt2_setmode(const op *o) {
+    int bits = o->arg & 0xff;
+    P32SetMode(bits, o->arg >> 8);
+    return ++o;
 }
 
-unsigned char *jt2_xferinst_buf(unsigned char *p) {
+const op *jt2_xferinst_buf(const op *o) {
     P32XferInstruction(ucDownloadBuffer.readInt());
-    return ++p;
+    return ++o;
 }
 
-unsigned char *jt2_xfrfastdat_buf(unsigned char *p) {
-    P32XferFastData32(ucDownloadBuffer.readInt());
-    return ++p;
+const op *jt2_xfrfastdat_buf(const op *o) {    // arg: words
+    P32XferFastDataBlock(o->arg);
+    return ++o;
 }
 
-unsigned char *jt2_xfrfastdat_lit(unsigned char *p) {
-    unsigned i = 0;
-    for (int j = 0; j < 32; j += 8) i += (*++p) << j;
-    P32XferFastData32(i);
-    return ++p;
+const op *jt2_xfrfastdat_lit(const op *o) {
+    P32XferFastData32(o->arg);
+    return ++o;
 }
 
-unsigned char *jt2_get_pe_resp(unsigned char *p) {
+const op *jt2_get_pe_resp(const op *o) {
     ucUploadBuffer.writeInt(P32GetPEResponse());
-    return ++p;
+    return ++o;
 }
 
-unsigned char *jt2_wait_pe_resp(unsigned char *p) {
+const op *jt2_wait_pe_resp(const op *o) {
     P32GetPEResponse();
-    return ++p;
+    return ++o;
 }
 
-unsigned char *vpp_off(unsigned char *p) {
+const op *jt2_pe_crc32(const op *o) {
+    unsigned address = ucDownloadBuffer.readInt();
+    ucUploadBuffer.writeInt(P32PECrc32(address, ucDownloadBuffer.readInt()));
+    return ++o;
+}
+
+const op *jt2_set_timeout(const op *o) {
+    pracc_timeout = o->arg ? o->arg : PRACC_TIMEOUT;
+    return ++o;
+}
+
+const op *vpp_off(const op *o) {
     TRISCbits.TRISC0 = 1;
-    return ++p;
+    return ++o;
 }
 
-unsigned char *vpp_on(unsigned char *p) {
+const op *vpp_on(const op *o) {
     TRISCbits.TRISC0 = 0;
-    return ++p;
+    return ++o;
 }
 
-unsigned char *mclr_gnd_on(unsigned char *p) {
+const op *mclr_gnd_on(const op *o) {
     LATCbits.LATC0 = 0;
     TRISCbits.TRISC0 = 0;
-    return ++p;
+    return ++o;
 }
 
-unsigned char *mclr_gnd_off(unsigned char *p) {
+const op *mclr_gnd_off(const op *o) {
     LATCbits.LATC0 = 1;
-    return ++p;
+    return ++o;
 }
 
-unsigned char *set_icsp_pins(unsigned char *p) {
-    icsp_pins = *++p;
+const op *set_icsp_pins(const op *o) {
+    icsp_pins = o->arg;
     LATBbits.LATB2 = icsp_pins & 4 ? 1 : 0;     // PGC logic
     LATBbits.LATB3 = icsp_pins & 8 ? 1 : 0;     // PGD logic
     TRISBbits.TRISB2 = icsp_pins & 1 ? 1 : 0;   // PGC dir
     TRISBbits.TRISB3 = icsp_pins & 2 ? 1 : 0;   // PGD dir
-    return ++p;
-}
-
-void delay_64(unsigned t) {     // t * 6.4 us
-    TMR1 = 0;
-    T1CONbits.ON = 1;
-    while (TMR1 < t) wait(0);
-    T1CONbits.ON = 0;    
+    return ++o;
 }
 
-unsigned char *delay_short(unsigned char *p) {
-    delay_64(*++p * 7);          // 6.4us * 7 = 44.8us (3)
-    return ++p;
+const op *delay_short(const op *o) {
+    unsigned t = _CP0_GET_COUNT();
+    delay_ticks(o->arg * DELAY_SHORT_TICKS);
+    counters.delay += _CP0_GET_COUNT() - t;
+    return ++o;
 }
 
-unsigned char *delay_long(unsigned char *p) {
-    delay_64(*++p * 853);       // 6.4us * 781 = 4998us 853
-    return ++p;
+const op *delay_long(const op *o) {
+    unsigned t = _CP0_GET_COUNT();
+    delay_ticks(o->arg * DELAY_LONG_TICKS);
+    counters.delay += _CP0_GET_COUNT() - t;
+    return ++o;
 }
 
-unsigned char *busy_led_off(unsigned char *p) {
+const op *busy_led_off(const op *o) {
     BUSY_LED = 0;
-    return ++p;
+    return ++o;
 }
 
-unsigned char *busy_led_on(unsigned char *p) {
+const op *busy_led_on(const op *o) {
     BUSY_LED = 1;
-    return ++p;
+    return ++o;
 }
 
-unsigned char *loop(unsigned char *p) {
-    static unsigned char *loopindex;
-    static int loopcount = 0;
-    if (loopcount) {
-        wait(0);
-        if (!--loopcount) loopindex = p + 3;
+// The first time a loop op is reached it is pushed with its count, so
+// the body runs count + 1 times in all; a count of 0 falls through.
+const op *loop_back(const op *o, unsigned count) {
+    context &c = *ctx;
+    if (c.depth && (c.loop[c.depth - 1].at == o)) {
+        if (!--c.loop[c.depth - 1].count) {
+            c.depth--;
+            return ++o;
+        }
     } else {
-        loopindex = p - p[1];
-        loopcount = p[2];
+        if (!count) return ++o;
+        if (c.depth == LOOP_DEPTH) {
+            Pk2Status.EmptyScript = 1;
+            return 0;
+        }
+        c.loop[c.depth].at = o;
+        c.loop[c.depth++].count = count;
     }
-    return loopindex;
+    wait(0);
+    return o - (o->arg & 0xffff);
 }
 
-unsigned char *write_byte_literal(unsigned char *p) {
-    ShiftByteOutICSP(*++p);
-    return ++p;
+const op *loop(const op *o) {   // arg: {ops back} {-} {count}
+    return loop_back(o, o->arg >> 16);
 }
 
-unsigned char *set_icsp_speed(unsigned char *p) {
-    icsp_baud = *++p;
-    return ++p;
+const op *loopbuffer(const op *o) { // count from the download buffer
+    unsigned count = 0;
+    if (!ctx->depth || (ctx->loop[ctx->depth - 1].at != o)) {
+        count = ucDownloadBuffer.readByte();
+        count += ucDownloadBuffer.readByte() << 8;
+    }
+    return loop_back(o, count);
+}
+
+// A jump that lands outside a loop's body leaves the loop: it is
+// dropped, so its LOOP op starts afresh when next reached.
+const op *jump(const op *o, int n) {
+    context &c = *ctx;
+    const op *to = o + n, *at;
+    for (; c.depth; c.depth--) {
+        at = c.loop[c.depth - 1].at;
+        if ((to >= at - (at->arg & 0xffff)) && (to <= at)) break;
+    }
+    return to;
+}
+
+const op *goto_index(const op *o) { // arg: signed ops to jump
+    return jump(o, (int)o->arg);
 }
 
-unsigned char *nop(unsigned char *p) { return ++p; }
-
-unsigned char *abort(unsigned char*) { return 0; }
-
-typedef unsigned char* (*sf)(unsigned char*);
-
-const sf script[] = {
-abort, // JT2_PE_PROG_RESP
-jt2_wait_pe_resp, // JT2_WAIT_PE_RESP
-jt2_get_pe_resp, // JT2_GET_PE_RESP
-jt2_xferinst_buf, // JT2_XFERINST_BUF
-jt2_xfrfastdat_buf, // JT2_XFRFASTDAT_BUF
-jt2_xfrfastdat_lit, // JT2_XFRFASTDAT_LIT
-jt2_xferdata32_lit, // JT2_XFERDATA32_LIT
-jt2_xferdata8_lit, // JT2_XFERDATA8_LIT
-jt2_sendcmd, // JT2_SENDCMD
-jt2_setmode, // JT2_SETMODE
-abort, // UNIO_TX_RX
-abort, // UNIO_TX
-abort, // MEASURE_PULSE
-abort, // ICDSLAVE_TX_BUF_BL
-abort, // ICDSLAVE_TX_LIT_BL
-abort, // ICDSLAVE_RX_BL
-abort, // SPI_RDWR_BYTE_BUF
-abort, // SPI_RDWR_BYTE_LIT
-abort, // SPI_RD_BYTE_BUF
-abort, // SPI_WR_BYTE_BUF
-abort, // SPI_WR_BYTE_LIT
-abort, // I2C_RD_BYTE_NACK
-abort, // I2C_RD_BYTE_ACK
-abort, // I2C_WR_BYTE_BUF
-abort, // I2C_WR_BYTE_LIT
-abort, // I2C_STOP
-abort, // I2C_START
-abort, // AUX_STATE_BUFFER
-abort, // SET_AUX
-abort, // WRITE_BITS_BUF_HLD
-abort, // WRITE_BITS_LIT_HLD
-abort, // CONST_WRITE_DL  
-abort, // WRITE_BUFBYTE_W 
-abort, // WRITE_BUFWORD_W 
-abort, // RD2_BITS_BUFFER 
-abort, // RD2_BYTE_BUFFER 
-abort, // VISI24
-abort, // abort24
-abort, // COREINST24
-abort, // COREINST18
-abort, // POP_DOWNLOAD
-abort, // ICSP_STATES_BUFFER
-abort, // LOOPBUFFER
-abort, // ICDSLAVE_TX_BUF 
-abort, // ICDSLAVE_TX_LIT 
-abort, // ICDSLAVE_RX
-abort, // POKE_SFR
-abort, // PEEK_SFR
-abort, // EXIT_SCRIPT
-abort, // GOTO_INDEX
-abort, // IF_GT_GOTO
-abort, // IF_EQ_GOTO
-delay_short, // DELAY_SHORT
-delay_long, // DELAY_LONG
-loop, // LOOP
-set_icsp_speed, // SET_ICSP_SPEED
-abort, // READ_BITS
-abort, // READ_BITS_BUFFER
-abort, // WRITE_BITS_BUFFER
-abort, // WRITE_BITS_LITERAL
-abort, // READ_BYTE
-abort, // READ_BYTE_BUFFER
-abort, // WRITE_BYTE_BUFFER
-write_byte_literal, // WRITE_BYTE_LITERAL
-set_icsp_pins, // SET_ICSP_PINS
-busy_led_off, // BUSY_LED_OFF
-busy_led_on, // BUSY_LED_ON
-mclr_gnd_off, // MCLR_GND_OFF
-mclr_gnd_on, // MCLR_GND_ON
-nop, // VPP_PWM_OFF
-nop, // VPP_PWM_ON
-vpp_off, // VPP_OFF
-vpp_on, // VPP_ON
-abort, // VDD_GND_OFF
-nop, // VDD_GND_ON
-nop // VDD_OFF   
+// arg: {value} {signed ops to jump}, tested against the last byte put
+// in the upload buffer
+const op *if_eq_goto(const op *o) {
+    if (ucUploadBuffer.lastByte() == (o->arg & 0xff))
+        return jump(o, (int)o->arg >> 8);
+    return ++o;
+}
+
+const op *if_gt_goto(const op *o) {
+    if (ucUploadBuffer.lastByte() > (o->arg & 0xff))
+        return jump(o, (int)o->arg >> 8);
+    return ++o;
+}
+
+const op *exit_script(const op*) { return ctx->end; }
+
+const op *write_byte_literal(const op *o) {
+    ShiftByteOutICSP(o->arg);
+    return ++o;
+}
+
+const op *set_icsp_speed(const op *o) {
+    icsp_baud = o->arg;
+    icsp_half = icsp_baud * CORE_TICKS_US / 2;
+    return ++o;
+}
+
+const op *nop(const op *o) { return ++o; }
+
+const op *abort(const op*) { return 0; }
+
+const struct {
+    sf fn;
+    unsigned char operands;     // script bytes following the opcode
+} script[] = {
+{jt2_pe_crc32, 0}, // JT2_PE_CRC32
+{jt2_set_timeout, 2}, // JT2_SET_TIMEOUT
+{abort, 0}, // JT2_PE_PROG_RESP
+{jt2_wait_pe_resp, 0}, // JT2_WAIT_PE_RESP
+{jt2_get_pe_resp, 0}, // JT2_GET_PE_RESP
+{jt2_xferinst_buf, 0}, // JT2_XFERINST_BUF
+{jt2_xfrfastdat_buf, 0}, // JT2_XFRFASTDAT_BUF
+{jt2_xfrfastdat_lit, 4}, // JT2_XFRFASTDAT_LIT
+{jt2_xferdata32_lit, 4}, // JT2_XFERDATA32_LIT
+{jt2_xferdata8_lit, 1}, // JT2_XFERDATA8_LIT
+{jt2_sendcmd, 1}, // JT2_SENDCMD
+{jt2_setmode, 2}, // JT2_SETMODE
+{abort, 0}, // UNIO_TX_RX
+{abort, 0}, // UNIO_TX
+{abort, 0}, // MEASURE_PULSE
+{abort, 0}, // ICDSLAVE_TX_BUF_BL
+{abort, 0}, // ICDSLAVE_TX_LIT_BL
+{abort, 0}, // ICDSLAVE_RX_BL
+{abort, 0}, // SPI_RDWR_BYTE_BUF
+{abort, 0}, // SPI_RDWR_BYTE_LIT
+{abort, 0}, // SPI_RD_BYTE_BUF
+{abort, 0}, // SPI_WR_BYTE_BUF
+{abort, 0}, // SPI_WR_BYTE_LIT
+{abort, 0}, // I2C_RD_BYTE_NACK
+{abort, 0}, // I2C_RD_BYTE_ACK
+{abort, 0}, // I2C_WR_BYTE_BUF
+{abort, 0}, // I2C_WR_BYTE_LIT
+{abort, 0}, // I2C_STOP
+{abort, 0}, // I2C_START
+{abort, 0}, // AUX_STATE_BUFFER
+{abort, 0}, // SET_AUX
+{abort, 0}, // WRITE_BITS_BUF_HLD
+{abort, 0}, // WRITE_BITS_LIT_HLD
+{abort, 0}, // CONST_WRITE_DL  
+{abort, 0}, // WRITE_BUFBYTE_W 
+{abort, 0}, // WRITE_BUFWORD_W 
+{abort, 0}, // RD2_BITS_BUFFER 
+{abort, 0}, // RD2_BYTE_BUFFER 
+{abort, 0}, // VISI24
+{abort, 0}, // NOP24
+{abort, 0}, // COREINST24
+{abort, 0}, // COREINST18
+{abort, 0}, // POP_DOWNLOAD
+{abort, 0}, // ICSP_STATES_BUFFER
+{loopbuffer, 1}, // LOOPBUFFER
+{abort, 0}, // ICDSLAVE_TX_BUF 
+{abort, 0}, // ICDSLAVE_TX_LIT 
+{abort, 0}, // ICDSLAVE_RX
+{abort, 0}, // POKE_SFR
+{abort, 0}, // PEEK_SFR
+{exit_script, 0}, // EXIT_SCRIPT
+{goto_index, 1}, // GOTO_INDEX
+{if_gt_goto, 2}, // IF_GT_GOTO
+{if_eq_goto, 2}, // IF_EQ_GOTO
+{delay_short, 1}, // DELAY_SHORT
+{delay_long, 1}, // DELAY_LONG
+{loop, 2}, // LOOP
+{set_icsp_speed, 1}, // SET_ICSP_SPEED
+{abort, 0}, // READ_BITS
+{abort, 0}, // READ_BITS_BUFFER
+{abort, 0}, // WRITE_BITS_BUFFER
+{abort, 0}, // WRITE_BITS_LITERAL
+{abort, 0}, // READ_BYTE
+{abort, 0}, // READ_BYTE_BUFFER
+{abort, 0}, // WRITE_BYTE_BUFFER
+{write_byte_literal, 1}, // WRITE_BYTE_LITERAL
+{set_icsp_pins, 1}, // SET_ICSP_PINS
+{busy_led_off, 0}, // BUSY_LED_OFF
+{busy_led_on, 0}, // BUSY_LED_ON
+{mclr_gnd_off, 0}, // MCLR_GND_OFF
+{mclr_gnd_on, 0}, // MCLR_GND_ON
+{nop, 0}, // VPP_PWM_OFF
+{nop, 0}, // VPP_PWM_ON
+{vpp_off, 0}, // VPP_OFF
+{vpp_on, 0}, // VPP_ON
+{abort, 0}, // VDD_GND_OFF
+{nop, 0}, // VDD_GND_ON
+{nop, 0}, // VDD_OFF   
+{abort, 0} // VDD_ON
 };
 
-unsigned char *scriptEngine(unsigned char *ptr, unsigned len) {
-    unsigned char *end = ptr + len;
-    int index;
-    while ((ptr) && (ptr < end)) {
-        index = *ptr - SCRIPT_JT2_PE_PROG_RESP;
-        ptr = index < 0 ? 0 : (*script[index])(ptr);
+// True when the instruction at p[i] jumps; t is the script byte it lands on.
+bool isJump(const unsigned char *p, int i, int &t) {
+    switch (p[i]) {
+        case SCRIPT_LOOP:           // {bytes back}
+        case SCRIPT_LOOPBUFFER: t = i - p[i + 1]; return true;
+        case SCRIPT_GOTO_INDEX:     // {signed bytes}
+            t = i + (signed char)p[i + 1]; return true;
+        case SCRIPT_IF_EQ_GOTO:     // {value} {signed bytes}
+        case SCRIPT_IF_GT_GOTO: t = i + (signed char)p[i + 2]; return true;
+        default: return false;
+    }
+}
+
+// Translate len script bytes into ops. Returns the number of ops, or -1
+// for an instruction marked abort, a truncated operand or a jump that
+// does not land on an instruction of the same script (or just past it).
+// A run of JT2_XFRFASTDAT_BUF that no jump lands inside becomes a single
+// block transfer op.
+int decodeScript(const unsigned char *p, unsigned len, op *o) {
+    signed char at[BUF_SIZE + 1];   // op number of each script byte
+    bool target[BUF_SIZE + 1];      // a jump lands on this byte
+    unsigned i, j, k, prev, arg;
+    int index, t, n = 0;
+    if (len > BUF_SIZE) return -1;
+    for (i = 0; i <= len; i++) {
+        at[i] = -1;
+        target[i] = false;
+    }
+    for (i = 0; i < len; i += k + 1) {
+        index = p[i] - SCRIPT_JT2_PE_CRC32;
+        if ((index < 0) || (script[index].fn == abort)) return -1;
+        k = script[index].operands;
+        at[i] = 0;
+    }
+    if (i != len) return -1;
+    at[len] = 0;
+    for (i = 0; i < len; i += k + 1) {
+        k = script[p[i] - SCRIPT_JT2_PE_CRC32].operands;
+        if (isJump(p, i, t)) {
+            if ((t < 0) || (t > (int)len) || (at[t] < 0)) return -1;
+            target[t] = true;
+        }
+    }
+    for (i = 0, prev = len; i < len; prev = i, i += k + 1) {
+        k = script[p[i] - SCRIPT_JT2_PE_CRC32].operands;
+        if ((prev < len) && (p[prev] == SCRIPT_JT2_XFRFASTDAT_BUF) &&
+            (p[i] == SCRIPT_JT2_XFRFASTDAT_BUF) && !target[i])
+            at[i] = n - 1;
+        else at[i] = n++;
+    }
+    at[len] = n;
+    for (i = 0, prev = len; i < len; prev = i, i += k + 1) {
+        index = p[i] - SCRIPT_JT2_PE_CRC32;
+        k = script[index].operands;
+        n = at[i];
+        if ((prev < len) && (at[prev] == n)) {
+            o[n].arg++;                 // one more word in the block
+            continue;
+        }
+        for (arg = j = 0; j < k; j++) arg |= p[i + j + 1] << (j << 3);
+        if (isJump(p, i, t)) switch (p[i]) {
+            case SCRIPT_LOOP:           // {ops back} {-} {count}
+            case SCRIPT_LOOPBUFFER:
+                arg = (n - at[t]) | ((arg & 0xff00) << 8);
+                break;
+            case SCRIPT_GOTO_INDEX:     // {signed ops}
+                arg = at[t] - n;
+                break;
+            default:                    // {value} {signed ops}
+                arg = p[i + 1] | ((at[t] - n) << 8);
+        }
+        if (p[i] == SCRIPT_JT2_XFRFASTDAT_BUF) arg = 1;    // words
+        o[n].fn = script[index].fn;
+        o[n].arg = arg;
+        o[n].code = p[i];
+        if (p[i] == SCRIPT_JT2_SENDCMD)
+            for (j = 0; j < sizeof(fixed_command) / sizeof(*fixed_command); j++)
+                if (fixed_command[j].command == arg) o[n].fn = fixed_command[j].fn;
+    }
+    return at[len];
+}
+
+// Only waits when every IN report buffer is still queued.
+unsigned char *GetTxBuffer(void) {
+    unsigned char *buf;
+    unsigned t;
+    if ((buf = TxBuffer())) return buf;
+    t = _CP0_GET_COUNT();
+    while (!(buf = TxBuffer())) wait(0);
+    counters.tx_wait += _CP0_GET_COUNT() - t;
+    return buf;
+}
+
+// Push full 64-byte chunks of the upload buffer to the host. When block
+// is set, wait for the host to take them; that is the flow control which
+// keeps Pk2Status.UpLoadFull from ever being reached while streaming.
+void StreamUpload(bool block) {
+    unsigned char *buf;
+    while (ucUploadBuffer.count() >= BUF_SIZE) {
+        if (!(buf = block ? GetTxBuffer() : TxBuffer())) return;
+        ucUploadBuffer.read2buffer(buf, BUF_SIZE);
+        TxReport();
+    }
+}
+
+bool scriptEngine(const op *o, int n) {
+    context c, *outer = ctx;
+    unsigned timeout = pracc_timeout;
+    c.end = o + n;
+    c.depth = 0;
+    ctx = &c;
+    pracc_timeout = PRACC_TIMEOUT;
+    while ((o) && (o < c.end)) {
+        trace(TRACE_OP, o->code);
+        o = o->fn(o);
+        if (upload_stream)  // room for at least one more opcode's output
+            StreamUpload(ucUploadBuffer.room() < 9);
+    }
+    ctx = outer;
+    pracc_timeout = timeout;
+    return o;
+}
+
+op inline_ops[BUF_SIZE];        // CMD_EXECUTE_SCRIPT
+
+struct {                        // Script Buffer
+    unsigned short start, count;    // ops in script_ops[]
+    unsigned short sum;             // of the script bytes, for CSUM
+    unsigned char length;           // script bytes
+} script_table[SCRIPT_ENTRIES];
+op *script_ops;                 // rest of the arena
+unsigned script_ops_max, script_ops_used;
+
+// {ScriptLengthN} {Script1} ... {ScriptN}
+unsigned char *ExecuteScript(unsigned char *p) {
+    unsigned len = *p++;
+    int n = decodeScript(p, len, inline_ops);
+    if ((n < 0) || !scriptEngine(inline_ops, n)) return 0;
+    return p + len;
+}
+
+void DeleteScript(unsigned n) {
+    unsigned start = script_table[n].start, count = script_table[n].count;
+    for (unsigned i = start + count; i < script_ops_used; i++)
+        script_ops[i - count] = script_ops[i];
+    script_ops_used -= count;
+    for (int i = 0; i < SCRIPT_ENTRIES; i++)
+        if (script_table[i].start > start) script_table[i].start -= count;
+    script_table[n].count = script_table[n].length = 0;
+}
+
+// {Script#} {ScriptLengthN} {Script1} ... {ScriptN}
+// A script that does not decode is not stored.
+unsigned char *StoreScript(unsigned char *p) {
+    unsigned n = *p++, len = *p++;
+    int count;
+    if ((n >= SCRIPT_ENTRIES) || (len > SCRIPT_MAXLEN)) {
+        Pk2Status.ScriptBufOvrFlow = 1;
+        return 0;
+    }
+    DeleteScript(n);
+    count = decodeScript(p, len, inline_ops);
+    if ((count < 0) || (script_ops_used + count > script_ops_max)) {
+        Pk2Status.ScriptBufOvrFlow = 1;
+        return p + len;
+    }
+    script_table[n].start = script_ops_used;
+    script_table[n].count = count;
+    script_table[n].length = len;
+    script_table[n].sum = 0;
+    for (unsigned i = 0; i < len; i++) script_table[n].sum += p[i];
+    for (int i = 0; i < count; i++) script_ops[script_ops_used++] = inline_ops[i];
+    return p + len;
+}
+
+// {Script#} {iterations}
+unsigned char *RunScript(unsigned char *p) {
+    unsigned n = *p++, iterations = *p++;
+    if ((n >= SCRIPT_ENTRIES) || !script_table[n].length) {
+        Pk2Status.EmptyScript = 1;
+        return p;
+    }
+    while (iterations--)
+        if (!scriptEngine(script_ops + script_table[n].start, script_table[n].count))
+            return 0;
+    return p;
+}
+
+void ClearScripts(void) {
+    for (int i = 0; i < SCRIPT_ENTRIES; i++)
+        script_table[i].count = script_table[i].length = 0;
+    script_ops_used = 0;
+}
+
+// Refused while a job or the upload stream is using the rings.
+bool Partition(unsigned download, unsigned upload) {
+    if (row_job.rows || pe_job.slot || upload_stream) return false;
+    if ((download & (download - 1)) || (upload & (upload - 1)) ||
+        (download < BUF_SIZE) || (upload < BUF_SIZE) ||
+        (download > ARENA_SIZE) || (upload > ARENA_SIZE - download)) return false;
+    ucDownloadBuffer.setBuffer(arena, download);
+    ucUploadBuffer.setBuffer(arena + download, upload);
+    ClearDownload();
+    script_ops = (op *)(arena + download + upload);
+    script_ops_max = (ARENA_SIZE - download - upload) / sizeof(op);
+    ClearScripts();
+    return true;
+}
+
+// {download log2} {upload log2}, 0 0 leaves the layout as it is
+// Reply {status} {download} {upload} {script ops} {arena}, 32-bit each
+unsigned char *SendPartition(unsigned char *p) {
+    unsigned char *outbuffer = GetTxBuffer();
+    unsigned status = 0, layout[5];
+    if (p[0] | p[1])
+        status = (p[0] < 32) && (p[1] < 32) && Partition(1u << p[0], 1u << p[1]) ? 0 : ~0u;
+    layout[0] = status;
+    layout[1] = ucDownloadBuffer.size();
+    layout[2] = ucUploadBuffer.size();
+    layout[3] = script_ops_max;
+    layout[4] = ARENA_SIZE;
+    for (int i = 0; i < 5; i++)
+        for (int j = 0; j < 4; j++) outbuffer[i * 4 + j] = layout[i] >> (j * 8);
+    TxReport();
+    return p + 2;
+}
+
+// {LenSumL} {LenSumH} {BufSumL} {BufSumH}
+void SendScriptChecksum(void) {
+    unsigned char *outbuffer = GetTxBuffer();
+    unsigned length_sum = 0, buffer_sum = 0;
+    for (int i = 0; i < SCRIPT_ENTRIES; i++) {
+        length_sum += script_table[i].length;
+        buffer_sum += script_table[i].sum;
     }
-    return ptr;
+    outbuffer[0] = length_sum & 0xff;
+    outbuffer[1] = length_sum >> 8;
+    outbuffer[2] = buffer_sum & 0xff;
+    outbuffer[3] = buffer_sum >> 8;
+    TxReport();
+}
+
+// {bits/s} {bits} {ticks}, all 32-bit, then starts a new measurement
+void SendIcspRate(void) {
+    unsigned char *outbuffer = GetTxBuffer();
+    unsigned bits = icsp_bits - rate_bits, ticks = icsp_ticks - rate_ticks;
+    unsigned rate = ticks ?
+        (unsigned long long)bits * CORE_TICKS_US * 1000000 / ticks : 0;
+    unsigned values[] = { rate, bits, ticks };
+    for (int i = 0; i < 12; i++) outbuffer[i] = values[i >> 2] >> ((i & 3) << 3);
+    rate_bits = icsp_bits;
+    rate_ticks = icsp_ticks;
+    TxReport();
+}
+
+// Reply {timeouts} {polls[1..15]} {latency[16]}, 16-bit each, and
+// restart. A wait takes at least one poll, so polls[0] stays empty.
+void SendPrAccStats(void) {
+    unsigned char *outbuffer = GetTxBuffer();
+    int i;
+    outbuffer[0] = pracc_timeouts;
+    outbuffer[1] = pracc_timeouts >> 8;
+    for (i = 1; i < PRACC_BUCKETS; i++) {
+        outbuffer[2 * i] = pracc_polls[i];
+        outbuffer[1 + 2 * i] = pracc_polls[i] >> 8;
+    }
+    for (i = 0; i < PRACC_BUCKETS; i++) {
+        outbuffer[32 + 2 * i] = pracc_latency[i];
+        outbuffer[33 + 2 * i] = pracc_latency[i] >> 8;
+    }
+    for (i = 0; i < PRACC_BUCKETS; i++) pracc_polls[i] = pracc_latency[i] = 0;
+    pracc_timeouts = 0;
+    TxReport();
+}
+
+// Reply the slot header {magic} {version} {inst} {fast} {crc}, 32-bit
+// each; the magic is only right for a complete slot.
+unsigned char *SendPEInfo(unsigned char *p) {
+    unsigned char *outbuffer = GetTxBuffer();
+    bool valid = *p < PE_SLOTS;
+    if (!valid) Pk2Status.EmptyScript = 1;
+    for (int i = 0; i < 20; i++)
+        outbuffer[i] = valid ? pe_cache[*p][i >> 2] >> ((i & 3) << 3) : 0;
+    TxReport();
+    return ++p;
+}
+
+// Reply {tasks} then {runs} {ticks} {max ticks} 32-bit each per task.
+void SendTaskStats(void) {
+    unsigned char *outbuffer = GetTxBuffer();
+    unsigned stats[3];
+    int n, i;
+    static_assert(1 + TASKS * 12 <= BUF_SIZE, "task stats reply");
+    for (n = 0; (n < TASKS) && TaskStats(n, stats); n++)
+        for (i = 0; i < 12; i++)
+            outbuffer[1 + n * 12 + i] = stats[i >> 2] >> ((i & 3) << 3);
+    outbuffer[0] = n;
+    TxReport();
+}
+
+// Reply {events} {lost 16-bit} then {time} {event} 32-bit each for up
+// to 7 of the oldest events, which are dropped from the ring.
+void SendTrace(void) {
+    unsigned char *outbuffer = GetTxBuffer();
+    unsigned i, j, n, at;
+    unsigned ie = __builtin_disable_interrupts();
+    n = trace_count < 7 ? trace_count : 7;
+    at = trace_head - trace_count;
+    for (i = 0; i < n; i++, at++)
+        for (j = 0; j < 4; j++) {
+            outbuffer[3 + 8 * i + j] = trace_ring[at & (TRACE_EVENTS - 1)].time >> (j << 3);
+            outbuffer[7 + 8 * i + j] = trace_ring[at & (TRACE_EVENTS - 1)].event >> (j << 3);
+        }
+    trace_count -= n;
+    outbuffer[0] = n;
+    outbuffer[1] = trace_lost;
+    outbuffer[2] = trace_lost >> 8;
+    trace_lost = 0;
+    if (ie & 1) __builtin_enable_interrupts();
+    TxReport();
+}
+
+// Reply the running counters since the last read, 32-bit each:
+// {reports in} {reports out} {download in} {download out} {upload in}
+// {upload out} {ICSP bits} {PrAcc polls} {ICD timeouts} {IN wait ticks}
+// {delay ticks} {OUT queue depth max} {OUT NAK count} {OUT NAK ticks}
+void SendCounters(void) {
+    unsigned char *outbuffer = GetTxBuffer();
+    unsigned values[14];
+    HIDStats(values);               // 0, 1, 11 - 13
+    values[11] = values[2];
+    values[12] = values[3];
+    values[13] = values[4];
+    values[2] = ucDownloadBuffer.bytes_in;
+    values[3] = ucDownloadBuffer.bytes_out;
+    values[4] = ucUploadBuffer.bytes_in;
+    values[5] = ucUploadBuffer.bytes_out;
+    values[6] = icsp_bits - counters.icsp_bits;
+    values[7] = counters.pracc_polls;
+    values[8] = counters.icd_timeouts;
+    values[9] = counters.tx_wait;
+    values[10] = counters.delay;
+    for (int i = 0; i < 56; i++) outbuffer[i] = values[i >> 2] >> ((i & 3) << 3);
+    ucDownloadBuffer.bytes_in = ucDownloadBuffer.bytes_out = 0;
+    ucUploadBuffer.bytes_in = ucUploadBuffer.bytes_out = 0;
+    counters.icsp_bits = icsp_bits;
+    counters.pracc_polls = counters.icd_timeouts = 0;
+    counters.tx_wait = counters.delay = 0;
+    TxReport();
 }
 
 void SendStatusUSB(void) {
-    while (!HIDReportTxd()) wait(0);
+    unsigned char *outbuffer = GetTxBuffer();
     Pk2Status.Status &= 0xFFF3;    // clear bits to be tested
     if (Vpp_ON_pin)         // active high
         Pk2Status.VppOn = 1;
     if (!MCLR_TGT_pin)       // active high
         Pk2Status.VppGNDOn = 1;
 
-	outbuffer[0] = Pk2Status.Status & 0xff;
-	outbuffer[1] = Pk2Status.Status >> 8;
+    outbuffer[0] = Pk2Status.Status & 0xff;
+    outbuffer[1] = Pk2Status.Status >> 8;
 
     // Now that it's in the USB buffer, clear errors & flags
-    Pk2Status.Status &= 0x8F;
+    Pk2Status.Status &= 0x0F;
     BUSY_LED = 0;                   // ensure it stops blinking at off.
 
     // transmit status
-    HIDTxReport(outbuffer);
+    TxReport();
 } // end void SendStatusUSB(void)
 
 } // anonymous namespace
 
 void ProcessIO(void) {
-    unsigned char *ptr = inbuffer;
-    unsigned temp;
+    unsigned char *report, *ptr, *outbuffer;
+    unsigned command;
+    if (go_request && !replay) StartReplay();
+    report = replay ? (unsigned char *)replay : HIDReportRxd();
+    ptr = resume ? resume : report;
     if (!PROG_SWITCH_pin)   // active low
         Pk2Status.ButtonPressed = 1;
-    if (HIDReportRxd()) {
-        while ((ptr) && (ptr < (inbuffer + 64)))
-            switch ((int)*ptr) {
+    if (row_job.rows) ProgramRows();
+    if (pe_job.slot) StorePEWords();
+    SendCredit();
+    if (upload_stream) StreamUpload(false);
+    if (report) {
+        if (!Unpack()) return;          // download buffer full, hold report
+        if (learning && !resume) Learn(report);
+        resume = 0;
+        while ((ptr) && (ptr < (report + BUF_SIZE))) {
+            command = *ptr;
+            if (replay && ReplayHold(ptr)) {
+                resume = ptr;
+                return;
+            }
+            trace(TRACE_COMMAND, command);
+            switch (command) {
                 case CMD_EXECUTE_SCRIPT:
-                    temp = *++ptr;
-                    ptr = scriptEngine(++ptr, temp);
+                    ptr = ExecuteScript(++ptr);
+                    break;
+                case CMD_DOWNLOAD_SCRIPT:
+                    ptr = StoreScript(++ptr);
+                    break;
+                case CMD_RUN_SCRIPT:
+                    ptr = RunScript(++ptr);
                     break;
+                case CMD_CLEAR_SCRIPT_BUFFER:
+                    ClearScripts();
+                    ptr++; break;
+                case CMD_SCRIPT_BUFFER_CSUM:
+                    SendScriptChecksum();
+                    ptr++; break;
                 case CMD_CLEAR_DOWNLOAD_BUFFER:
-                    ucDownloadBuffer.clearBuffer();
+                    ClearDownload();
                     ptr++; break;
                 case CMD_CLEAR_UPLOAD_BUFFER:
                     ucUploadBuffer.clearBuffer();
@@ -475,20 +1699,72 @@ void ProcessIO(void) {
                 case CMD_DOWNLOAD_DATA:
                     ptr = ucDownloadBuffer.writeBuffer(++ptr);
                     break;
+                case CMD_DOWNLOAD_PACKED:
+                    ptr = DownloadPacked(++ptr, report + BUF_SIZE);
+                    break;
+                case CMD_PROGRAM_ROWS:
+                    ptr = StartRows(++ptr);
+                    break;
+                case CMD_PE_STORE:
+                    ptr = StorePE(++ptr);
+                    break;
+                case CMD_PE_INFO:
+                    ptr = SendPEInfo(++ptr);
+                    break;
+                case CMD_PE_INJECT:
+                    ptr = InjectPE(++ptr);
+                    break;
+                case CMD_ENTER_LEARN_MODE:
+                    ptr = EnterLearn(++ptr);
+                    break;
+                case CMD_EXIT_LEARN_MODE:
+                    ExitLearn();
+                    ptr++; break;
+                case CMD_ENABLE_PK2GO_MODE:
+                    ptr = EnablePk2Go(++ptr);
+                    break;
                 case CMD_UPLOAD_DATA:
-                    while (!HIDReportTxd()) wait(0);
+                    outbuffer = GetTxBuffer();
                     *outbuffer = ucUploadBuffer.read2buffer(outbuffer + 1, 63);
-                    HIDTxReport(outbuffer); ptr++; break;
+                    TxReport(); ptr++; break;
                 case CMD_UPLOAD_DATA_NOLEN:
-                    while (!HIDReportTxd()) wait(0);
+                    outbuffer = GetTxBuffer();
                     ucUploadBuffer.read2buffer(outbuffer, 64);
-                    HIDTxReport(outbuffer); ptr++; break; 
+                    TxReport(); ptr++; break; 
                 case CMD_GET_VERSION:
-                    while (!HIDReportTxd()) wait(0);
+                    outbuffer = GetTxBuffer();
                     outbuffer[0] = MAJORVERSION;
                     outbuffer[1] = MINORVERSION;
                     outbuffer[2] = DOTVERSION;
-                    HIDTxReport(outbuffer); ptr++; break;                     
+                    TxReport(); ptr++; break;                     
+                case CMD_UPLOAD_STREAM:
+                    upload_stream = *++ptr;
+                    ptr++; break;
+                case CMD_READ_ICSP_RATE:
+                    SendIcspRate();
+                    ptr++; break;
+                case CMD_READ_PRACC_STATS:
+                    SendPrAccStats();
+                    ptr++; break;
+                case CMD_READ_TASKS:
+                    SendTaskStats();
+                    ptr++; break;
+                case CMD_TRACE:
+                    tracing = *++ptr;
+                    trace_count = trace_lost = 0;
+                    ptr++; break;
+                case CMD_READ_TRACE:
+                    SendTrace();
+                    ptr++; break;
+                case CMD_READ_COUNTERS:
+                    SendCounters();
+                    ptr++; break;
+                case CMD_PARTITION:
+                    ptr = SendPartition(++ptr);
+                    break;
+                case CMD_PRACC_FAULT:
+                    pracc_fault = ptr[1] | (ptr[2] << 8) | (ptr[3] << 16) | (ptr[4] << 24);
+                    ptr += 5; break;
                 case CMD_READ_STATUS:
                     SendStatusUSB();
                 case CMD_NO_OPERATION: ptr++; break;
@@ -496,12 +1772,16 @@ void ProcessIO(void) {
                 case CMD_SET_VPP: ptr += 4; break;
                 default: ptr = 0;
             }
-        HIDRxReport();
+            if (!Unpack()) {
+                resume = ptr;
+                return;
+            }
+        }
+        ReleaseReport();
     }
 }
 
 void pickit_init(void) {
-    T1CONbits.TCKPS = 3;            // prescalar = 256
     ANSELBCLR = 0xc;                // B2,B3
     ANSELCbits.ANSC0 = 0;
     LATCSET = TRISCSET = 1;         // VPP (C0)
@@ -510,6 +1790,12 @@ void pickit_init(void) {
     CNPUBbits.CNPUB8 = 1;           // SW pull up
 	icsp_pins = 0x03;		// default inputs
 	icsp_baud = 0x00;		// default fastest
+    icsp_half = 0;
+    pracc_fault = 0;
+    pracc_timeout = PRACC_TIMEOUT;
+    row_job.rows = 0;
+    pe_job.slot = 0;
+    Partition(DOWNLOAD_SIZE, UPLOAD_SIZE);
     Pk2Status.Status = Pk2Status.RESETMASK;
 }
 
@@ -519,11 +1805,14 @@ unsigned test(unsigned data) {
 
 void led(bool b) { BUSY_LED = b ? 1 : 0; }
 
-int key;
+unsigned key;
+
+void TraceUSB(int bd, int length) { trace(TRACE_USB, bd | length << 8); }
 
 void button(unsigned t) {
     if ((!(t & 15)) && (key != (PORTB & 0x100))) {
         key ^= 0x100;
         if (!key) LATBINV = 0x200;
+        if (!key) go_request = true;
     }
 }
\ No newline at end of file
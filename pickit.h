@@ -6,11 +6,13 @@
 #define DOTVERSION      0
 
 #define BUF_SIZE        64          // USB buffers
-#define DOWNLOAD_SIZE	260			// download buffer size
-#define UPLOAD_SIZE		132			// upload buffer size
-// 4 bytes are added to DOWNLOAD_SIZE and UPLOAD_SIZE
-// to avoid overflow. The way I handle ring buffer treat
-// filled-up buffer as overflow.
+#define ARENA_SIZE      20480       // download, upload and script op RAM
+#define DOWNLOAD_SIZE	256			// default download buffer size, power of two
+#define UPLOAD_SIZE		128			// default upload buffer size, power of two
+#define SCRIPT_ENTRIES  32          // script numbers 0 - 31 as PICkit 2
+#define SCRIPT_MAXLEN   61          // longest script fitting in a report
+#define LOOP_DEPTH      4           // nested LOOP / LOOPBUFFER, deeper sets EmptyScript
+#define TASKS           4           // scheduled tasks, CMD_READ_TASKS fits 5
 
 void pickit_init(void);
 void ProcessIO(void);
@@ -18,6 +20,11 @@ void ProcessIO(void);
 /*
  * Script instructions.
  */
+#define SCRIPT_JT2_PE_CRC32        0xB1     // + CRC-32 of {address} {words} from the
+                                            // download buffer, read via the PE; the
+                                            // digest goes to upload (not in PICkit 2)
+#define SCRIPT_JT2_SET_TIMEOUT     0xB2     // + 2 PrAcc deadline in ms for the rest
+                                            // of the script, 0 default (not in PICkit 2)
 #define SCRIPT_JT2_PE_PROG_RESP    0xB3     // +
 #define SCRIPT_JT2_WAIT_PE_RESP    0xB4     // +
 #define SCRIPT_JT2_GET_PE_RESP     0xB5     // +
@@ -60,20 +67,20 @@ void ProcessIO(void);
 #define SCRIPT_COREINST18          0xDA     //
 #define SCRIPT_POP_DOWNLOAD        0xDB     //
 #define SCRIPT_ICSP_STATES_BUFFER  0xDC     //
-#define SCRIPT_LOOPBUFFER          0xDD     //
+#define SCRIPT_LOOPBUFFER          0xDD     // + 1 count from download buffer
 #define SCRIPT_ICDSLAVE_TX_BUF     0xDE     //
 #define SCRIPT_ICDSLAVE_TX_LIT     0xDF     //
 #define SCRIPT_ICDSLAVE_RX         0xE0     //
 #define SCRIPT_POKE_SFR            0xE1     //
 #define SCRIPT_PEEK_SFR            0xE2     //
-#define SCRIPT_EXIT_SCRIPT         0xE3     //
-#define SCRIPT_GOTO_INDEX          0xE4     //
-#define SCRIPT_IF_GT_GOTO          0xE5     //
-#define SCRIPT_IF_EQ_GOTO          0xE6     //
+#define SCRIPT_EXIT_SCRIPT         0xE3     // +
+#define SCRIPT_GOTO_INDEX          0xE4     // + 1 signed, from this opcode
+#define SCRIPT_IF_GT_GOTO          0xE5     // + 2 last upload byte > {1}
+#define SCRIPT_IF_EQ_GOTO          0xE6     // + 2 last upload byte == {1}
 #define SCRIPT_DELAY_SHORT         0xE7     // + 1 increments of 42.7us
 #define SCRIPT_DELAY_LONG          0xE8     // + 1 increments of 5.46ms
 #define SCRIPT_LOOP                0xE9     // + 2
-#define SCRIPT_SET_ICSP_SPEED      0xEA     // + 1
+#define SCRIPT_SET_ICSP_SPEED      0xEA     // + 1 PGC period in us, 0 fastest
 #define SCRIPT_READ_BITS           0xEB     //
 #define SCRIPT_READ_BITS_BUFFER    0xEC     //
 #define SCRIPT_WRITE_BITS_BUFFER   0xED     //
@@ -135,14 +142,104 @@ void ProcessIO(void);
 #define CMD_ENTER_UART_MODE        0xB3
 #define CMD_EXIT_UART_MODE         0xB4     // Exits the firmware from UART Mode
 #define CMD_ENTER_LEARN_MODE       0xB5     // {0x50} {0x4B} {0x32} {EEsize}
-                                            // Puts the firmware in PK2GO Learn Mode
-#define CMD_EXIT_LEARN_MODE        0xB6     // Ignore
+                                            // Puts the firmware in PK2GO Learn Mode:
+                                            // OUT reports are recorded to flash as run
+                                            // (1024 of them); past that recording stops
+                                            // and status bit 7, LearnOvrFlow, is set
+#define CMD_EXIT_LEARN_MODE        0xB6     // Ends Learn Mode, keeps the session
 #define CMD_ENABLE_PK2GO_MODE      0xB7     // {0x50} {0x4B} {0x32} {EEsize}
-                                            // Puts the firmware in PK2GO Mode
+                                            // Puts the firmware in PK2GO Mode: the
+                                            // switch replays the learned session while
+                                            // USB is not configured. Commands behind a
+                                            // row or PE job are held until it has room.
 #define CMD_LOGIC_ANALYZER_GO      0xB8     // {EdgeRising} {TrigMask} {TrigStates} {EdgeMask} {TrigCount} {PostTrigCountL} {PostTrigCountH} {SampleRateFactor}
                                             // {TrigLocL} {TrigLocH}
 #define CMD_COPY_RAM_UPLOAD        0xB9     // {StartAddrL} {StartAddrH}
 
+/*
+ * Extended commands (not in PICkit 2).
+ */
+#define CMD_UPLOAD_STREAM          0xC0     // {mode}
+                                            // 1: send every full 64 bytes of the upload
+                                            // buffer as an unsolicited NOLEN report
+                                            // 0: back to CMD_UPLOAD_DATA lockstep
+#define CMD_READ_ICSP_RATE         0xC1     // {bits/s} {bits} {ticks} 32-bit each
+                                            // Achieved 2-wire JTAG rate since last read
+#define CMD_PRACC_FAULT            0xC3     // {samples} 32-bit
+                                            // Report the next n PrAcc samples as not
+                                            // ready, 0xFFFFFFFF until cleared with 0.
+                                            // Exercises the ICDTimeOut paths
+#define CMD_READ_PRACC_STATS       0xC4     // Reply {timeouts} {polls[1..15]} {us[16]}
+                                            // 16-bit each: log2 histograms of polls
+                                            // and latency per PrAcc wait since last read,
+                                            // bucket n from 2^(n-1), the last saturating
+#define CMD_DOWNLOAD_PACKED        0xC5     // {RecordsLength} {Records}
+                                            // Expanded into the download buffer:
+                                            // 0nnnnnnn {n+1 bytes}    literal
+                                            // 10nnnnnn {byte}         n+3 copies
+                                            // 11nnnnnn {lo} {hi}      n:hi:lo+1 0xFF (blank)
+                                            // Records must not span reports; cut off ones
+                                            // set DownloadOvrFlow. When the buffer fills
+                                            // during CMD_PROGRAM_ROWS or CMD_PE_STORE the
+                                            // report is held, and later commands wait,
+                                            // until data is consumed; otherwise the rest
+                                            // is dropped and DownloadOvrFlow set
+#define CMD_PROGRAM_ROWS           0xC6     // {address 32-bit} {rows 16-bit}
+                                            // {words 16-bit} PE ROW_PROGRAM rows of
+                                            // {words} from the download buffer, in
+                                            // the background while the host keeps it
+                                            // filled. Rows of 0xFF are skipped. Finally
+                                            // uploads {status} {skipped} 32-bit each:
+                                            // 0, the PE response or ~0; ~0 at once
+                                            // when {words} is 0.
+                                            // Each time another 62 bytes are consumed,
+                                            // and at the end, pushes a credit report
+                                            // {0xC6} {bytes consumed 32-bit} {rows left};
+                                            // keep sent - consumed <= download size
+#define CMD_PE_STORE               0xC7     // {slot} {version} {inst words} {fast words}
+                                            // 16-bit each after slot. Caches a PE from
+                                            // the download buffer in programmer flash:
+                                            // loader instructions, then fast-data words
+#define CMD_PE_INFO                0xC8     // {slot} Reply {magic} {version} {inst words}
+                                            // {fast words} {CRC-32} 32-bit each,
+                                            // magic 0x45503233 when the slot is valid
+#define CMD_PE_INJECT              0xC9     // {slot} Loads the cached PE into the target
+                                            // (serial execution mode already entered)
+                                            // For all three a slot other than 0 or 1, or
+                                            // injecting an empty one, sets EmptyScript
+#define CMD_READ_TASKS             0xCA     // Reply {tasks} then {runs} {ticks} {max}
+                                            // 32-bit each per scheduled task: runtime
+                                            // in core timer ticks since last read
+#define CMD_TRACE                  0xCB     // {on} Starts or stops tracing, clears it
+#define CMD_READ_TRACE             0xCC     // Reply {events} {lost 16-bit} then up to 7
+                                            // {core timer} {event} 32-bit each, oldest
+                                            // first; event is TRACE_ id | argument << 8
+#define CMD_READ_COUNTERS          0xCD     // Reply 32-bit counters since last read:
+                                            // {reports in} {reports out} {download in}
+                                            // {download out} {upload in} {upload out}
+                                            // {ICSP bits} {PrAcc polls} {ICD timeouts}
+                                            // {IN wait ticks} {delay ticks} {OUT queue
+                                            // depth max} {OUT NAKs} {OUT NAK ticks}
+#define CMD_PARTITION              0xCE     // {download log2} {upload log2} Splits the
+                                            // RAM arena, script ops get the rest; clears
+                                            // the buffers and scripts. 0 0 only reads.
+                                            // Reply {status} {download bytes} {upload
+                                            // bytes} {script ops} {arena bytes} 32-bit
+                                            // each, status ~0 if the layout is refused
+                                            // or a row or PE job or the upload stream
+                                            // is running. Script ops can be 0 (16 KB
+                                            // and 4 KB fill the arena): scripts are then
+                                            // not stored, ScriptBufOvrFlow, and only
+                                            // CMD_EXECUTE_SCRIPT runs them
+
+/*
+ * Trace events.
+ */
+#define TRACE_COMMAND   1           // command byte
+#define TRACE_OP        2           // script opcode
+#define TRACE_PRACC     3           // PrAcc wait in us, 0xFFFFFF timed out
+#define TRACE_USB       4           // EP1 BDT | length << 8
+
 #endif /* _PICKIT_H */
 
 /*
@@ -157,5 +254,26 @@ void ProcessIO(void);
  * CMD_SET_VDD
  * CMD_SET_VPP
  * CMD_READ_STATUS
+ * CMD_DOWNLOAD_SCRIPT
+ * CMD_RUN_SCRIPT
+ * CMD_CLEAR_SCRIPT_BUFFER
+ * CMD_SCRIPT_BUFFER_CSUM
+ * CMD_UPLOAD_STREAM
+ * CMD_READ_ICSP_RATE
+ * CMD_PRACC_FAULT
+ * CMD_READ_PRACC_STATS
+ * CMD_DOWNLOAD_PACKED
+ * CMD_PROGRAM_ROWS
+ * CMD_PE_STORE
+ * CMD_PE_INFO
+ * CMD_PE_INJECT
+ * CMD_READ_TASKS
+ * CMD_TRACE
+ * CMD_READ_TRACE
+ * CMD_READ_COUNTERS
+ * CMD_PARTITION
+ * CMD_ENTER_LEARN_MODE
+ * CMD_EXIT_LEARN_MODE
+ * CMD_ENABLE_PK2GO_MODE
 CMD_END_OF_BUFFER
 */
\ No newline at end of file
@@ -6,5 +6,8 @@
 
 #define USB_EP_COUNT 2
 
+#define HID_CONFIG 1        // HID interrupt endpoints (PICkit 2 compatible)
+#define VENDOR_CONFIG 2     // vendor class bulk endpoints on the same EP1
+
 
 #endif /* _USB_CONFIG_H */
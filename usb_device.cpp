@@ -41,8 +41,7 @@ namespace {
     short pp0out, pp0in;
     int USBActiveConfiguration;
 
-    char *virt2phy(char* adr) { return (char*)(((unsigned)adr) & 0x1fffffff); } 
-    char *phy2virt(char* adr) { return (char*)(((unsigned)adr) | 0xa0000000); }
+    char *virt2phy(char* adr) { return (char*)(((unsigned long)adr) & 0x1fffffff); } 
     
     void prepare_for_setup(void) {
         U1EP0 = 0xd;                    // EPRXEN, EPTXEN, EPHSHK
@@ -63,6 +62,7 @@ namespace {
         U1ADDR = U1EIR = U1IR = U1EP0 = 0;
         reset_non_zero_endpoint();
         prepare_for_setup();
+        ClassInitEndpoint(USBActiveConfiguration = 0);  // back to Default
         U1CONbits.PKTDIS = 0;
         IEC1bits.USBIE = 1;        
     }
@@ -74,13 +74,16 @@ namespace {
                     if ((phy_buffer = virt2phy(get_std_descriptor(SetupPkt.value))))
                         return true;
                     break;
+                case GET_CONFIGURATION:     // host picks HID or VENDOR_CONFIG
+                    phy_buffer = virt2phy((char*)&USBActiveConfiguration);
+                    return true;
                 case SET_CONFIGURATION:
                 case SET_ADDRESS: return true;
                 default: return false;
             }
         }
         if (SetupPkt.type == TYPE_CLASS)
-            return phy_buffer = virt2phy(ClassTrfSetupHandler(&SetupPkt));
+            return (phy_buffer = virt2phy(ClassTrfSetupHandler(&SetupPkt)));
         return false;
     }
     
@@ -101,7 +104,7 @@ namespace {
     
     void TRN_EP0_Handler(void) {
         BDT *bd = &bdt[U1STAT >> 2];
-        char *phy_buffer;
+        char *phy_buffer = 0;
         int stall;
         if (U1STAT & STAT_DIR) pp0in = U1STAT & STAT_PPBI ? 2 : 3;
         else pp0out = U1STAT & STAT_PPBI ? 0 : 1;
@@ -147,7 +150,7 @@ namespace {
 void USBDeviceInit(void) {
     while (U1PWRCbits.USBBUSY);	// wait for USB module
     U1PWRCbits.USBPWR = 1;		// power on USB
-    unsigned address = (unsigned)virt2phy((char*)&bdt);
+    unsigned address = (unsigned long)virt2phy((char*)&bdt);
     U1BDTP1 = address >> 8;
     U1BDTP2 = address >> 16;
     U1BDTP3 = address >> 24;
@@ -13,6 +13,7 @@
 
 #define _DEFAULT 0x80
 
+#define _BULK 2
 #define _INTERRUPT 3
 #define _OUT 0
 #define _IN 0x80
@@ -137,7 +138,7 @@ const struct __attribute__((packed)) {
         USB_DESCRIPTOR_CONFIGURATION,                // CONFIGURATION descriptor type
         sizeof(cfg01),          // Total length of data for this cfg   67, 62
         1,                      // Number of interfaces in this cfg
-        1,                      // Index value of this configuration
+        HID_CONFIG,             // Index value of this configuration
         2,                      // Configuration string index
         _DEFAULT,               // Attributes, see usb_device.h
         50                     // Max power consumption (2X mA)
@@ -191,8 +192,8 @@ const struct __attribute__((packed)) {
         USB_DESCRIPTOR_CONFIGURATION,                // CONFIGURATION descriptor type
         sizeof(cfg02),          // Total length of data for this cfg   67, 62
         1,                      // Number of interfaces in this cfg
-        1,                      // Index value of this configuration
-        0,                      // Configuration string index
+        VENDOR_CONFIG,          // Index value of this configuration
+        2,                      // Configuration string index
         _DEFAULT,               // Attributes, see usb_device.h
         50                     // Max power consumption (2X mA)
     },
@@ -211,17 +212,17 @@ const struct __attribute__((packed)) {
         7, /*sizeof(USB_EP_DSC)*/
         USB_DESCRIPTOR_ENDPOINT,   //Endpoint Descriptor
         1 | _IN,                   //EndpointAddress
-        _INTERRUPT,                //Attributes
+        _BULK,                     //Attributes
         USB_EP1_BUFF_SIZE,              //size
-        1                        //Interval
+        0                        //Interval
     },
     {
         7, /*sizeof(USB_EP_DSC)*/
         USB_DESCRIPTOR_ENDPOINT,   //Endpoint Descriptor
         1 | _OUT,                   //EndpointAddress
-        _INTERRUPT,                //Attributes
+        _BULK,                     //Attributes
         USB_EP1_BUFF_SIZE,              //size
-        1                        //Interval
+        0                        //Interval
     }    
 };
 
@@ -270,7 +271,7 @@ char *get_std_descriptor(short type) {
     switch (type) {
         case DEVICE: return (char*)&device_descriptor;
         case CONFIG1: return (char*)&cfg01;
-        case CONFIG2: return (char*)&cfg01;
+        case CONFIG2: return (char*)&cfg02;
         case STRING: return (char*)&sd000;
         case STRING1: return (char*)&sd001;
         case STRING2: return (char*)&sd002;